@@ -0,0 +1,414 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "arena.h"
+#include "axisaligbounbox.h"
+#include "mesh.h"
+#include "options.h"
+#include "scene.h"
+#include "stats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Accelerators for Scene::hit over the mesh triangles of the whole scene,
+// selected with --accel. "linear" is the default search without one: the
+// meshes one by one, each through its BVH. "grid" is a uniform grid and
+// "octree" a sparse octree, both walked cell by cell along the ray.
+
+// Triangle tests shared by the accelerators, which index the triangles of
+// Scene::triangles and need the object each of them belongs to
+class MeshAccelerator : public Accelerator
+{
+public:
+    explicit MeshAccelerator(std::pmr::memory_resource *mr) : m_object{mr} {}
+
+protected:
+    // bounds of all mesh triangles, after index_meshes
+    AxisAlignedBoundingBox m_bounds;
+
+    void index_meshes(const Scene &scene)
+    {
+        m_object.assign(scene.triangles.size(), 0);
+        m_bounds = AxisAlignedBoundingBox();
+        for (size_t i = 0; i < scene.objects.size(); ++i)
+        {
+            const SceneObject &o = scene.objects[i];
+            if (o.type != PRIMITIVE_MESH)
+                continue;
+            std::fill(&m_object[o.first], &m_object[o.first] + o.count, i);
+            if (o.count)
+                m_bounds.expand(o.box);
+        }
+    }
+
+    AxisAlignedBoundingBox triangle_box(const Scene &scene,
+                                        const uint32_t k) const
+    {
+        return triangle_bounds(scene.positions.data(), &scene.triangles[k],
+                               1);
+    }
+
+    // tests triangle k with (t_min, best), on a hit shrinks best and fills
+    // rec. Once rec holds a hit (is_hit), a triangle at exactly best of a
+    // later object replaces it, the tie rule of the mesh loop in Scene::hit
+    bool test(const Scene &scene, const uint32_t k, const ray &r,
+              const double t_min, double &best, HitRecord &rec,
+              const bool is_hit) const
+    {
+        HitRecord temp;
+        ++ray_stats.triangle_tests;
+        if (object_costs)
+            ++(*object_costs)[m_object[k]].triangle_tests;
+        bool tie = is_hit && m_object[k] > uint32_t(rec.object);
+        if (!hit_triangles(scene.positions.data(), &scene.triangles[k], 1, r,
+                           t_min, tie ? std::nextafter(best, INF) : best,
+                           temp))
+            return false;
+        best = temp.t;
+        rec = temp;
+        rec.primitive = k;
+        rec.object = m_object[k];
+        rec.material = scene.objects[rec.object].material;
+        return true;
+    }
+
+    // counts the final hit of a search for the heatmap
+    static void count_hit(const bool is_hit, const HitRecord &rec)
+    {
+        if (is_hit && object_costs)
+            ++(*object_costs)[rec.object].hits;
+    }
+
+    size_t object_bytes() const { return m_object.size() * sizeof(uint32_t); }
+
+private:
+    // object of every triangle
+    ArenaVector<uint32_t> m_object;
+};
+
+// Uniform grid of about DENSITY cells per triangle, each listing the
+// triangles whose box overlaps it, walked with a 3D-DDA (Amanatides & Woo)
+class GridAccelerator : public MeshAccelerator
+{
+public:
+    explicit GridAccelerator(std::pmr::memory_resource *mr)
+        : MeshAccelerator{mr}, m_start{mr}, m_refs{mr}
+    {
+    }
+
+    void build(const Scene &scene) override
+    {
+        index_meshes(scene);
+        size_t n = scene.triangles.size();
+        vec3 ext = n ? m_bounds.max() - m_bounds.min() : vec3();
+
+        // cell edge for DENSITY * n cubic cells, flat axes get one cell
+        double diag = len(ext);
+        double volume = std::max(ext.x, diag * 1e-3) *
+                        std::max(ext.y, diag * 1e-3) *
+                        std::max(ext.z, diag * 1e-3);
+        double per_unit = volume > 0 ? std::cbrt(DENSITY * n / volume) : 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            m_res[a] = std::max(
+                1, std::min(MAX_RES, int(std::ceil(ext[a] * per_unit))));
+            m_size[a] = ext[a] / m_res[a];
+            m_inv_size[a] = m_size[a] > 0 ? 1 / m_size[a] : 0;
+        }
+
+        // counting sort of the (cell, triangle) pairs
+        size_t cells = size_t(m_res[0]) * m_res[1] * m_res[2];
+        std::vector<uint32_t> count(cells + 1, 0);
+        auto each_cell = [&](const uint32_t k, auto f) {
+            AxisAlignedBoundingBox b = triangle_box(scene, k);
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = cell(a, b.min()[a]);
+                hi[a] = cell(a, b.max()[a]);
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        f(index(x, y, z));
+        };
+        for (uint32_t k = 0; k < n; ++k)
+            each_cell(k, [&](size_t c) { ++count[c + 1]; });
+        for (size_t c = 0; c < cells; ++c)
+            count[c + 1] += count[c];
+        m_start.assign(count.begin(), count.end());
+        m_refs.assign(count[cells], 0);
+        for (uint32_t k = 0; k < n; ++k)
+            each_cell(k, [&](size_t c) { m_refs[count[c]++] = k; });
+    }
+
+    bool hit(const Scene &scene, const ray &r, const double t_min,
+             const double t_max, HitRecord &rec) const override
+    {
+        double t0 = t_min, t1 = t_max;
+        if (m_refs.empty() || !m_bounds.clip(r, t0, t1))
+            return false;
+
+        const point3 o = r.origin();
+        const vec3 &inv = r.inv_direction();
+        point3 p = r.at(t0);
+        int c[3], step[3];
+        double next[3], delta[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            c[a] = cell(a, p[a]);
+            step[a] = r.sign(a) ? -1 : 1;
+            // an axis with one cell is only left through the grid bounds
+            if (m_res[a] == 1 || std::isinf(inv[a]))
+            {
+                next[a] = INF;
+                delta[a] = 0;
+                continue;
+            }
+            double plane =
+                m_bounds.min()[a] + (c[a] + (step[a] > 0)) * m_size[a];
+            next[a] = (plane - o[a]) * inv[a];
+            delta[a] = m_size[a] * std::fabs(inv[a]);
+        }
+
+        double best = t_max;
+        bool is_hit = false;
+        while (true)
+        {
+            ++ray_stats.box_tests;
+            size_t cell_index = index(c[0], c[1], c[2]);
+            for (uint32_t j = m_start[cell_index]; j < m_start[cell_index + 1];
+                 ++j)
+                is_hit |= test(scene, m_refs[j], r, t_min, best, rec, is_hit);
+
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                      : (next[1] < next[2] ? 1 : 2);
+            // a hit inside this cell is the closest one, one on its far
+            // side may still tie with a triangle of the next cell
+            if (best < next[a] || next[a] > t1)
+                break;
+            c[a] += step[a];
+            if (c[a] < 0 || c[a] >= m_res[a])
+                break;
+            next[a] += delta[a];
+        }
+        count_hit(is_hit, rec);
+        return is_hit;
+    }
+
+    size_t bytes() const override
+    {
+        return m_start.size() * sizeof(uint32_t) +
+               m_refs.size() * sizeof(uint32_t) + object_bytes();
+    }
+
+    const char *name() const override { return "grid"; }
+
+private:
+    static constexpr double DENSITY = 2;
+    static const int MAX_RES = 256;
+
+    int m_res[3];
+    double m_size[3], m_inv_size[3];
+    // triangles of cell c are m_refs[m_start[c] .. m_start[c + 1])
+    ArenaVector<uint32_t> m_start, m_refs;
+
+    int cell(const int a, const double x) const
+    {
+        int c = int((x - m_bounds.min()[a]) * m_inv_size[a]);
+        return std::max(0, std::min(m_res[a] - 1, c));
+    }
+
+    size_t index(const int x, const int y, const int z) const
+    {
+        return (size_t(z) * m_res[1] + y) * m_res[0] + x;
+    }
+};
+
+// Sparse octree splitting every node with more than LEAF_SIZE triangles at
+// its centre. The ray steps from leaf to leaf: it locates the leaf at its
+// current point, tests it, and moves on to where it leaves that leaf.
+class OctreeAccelerator : public MeshAccelerator
+{
+public:
+    explicit OctreeAccelerator(std::pmr::memory_resource *mr)
+        : MeshAccelerator{mr}, m_nodes{mr}, m_refs{mr}
+    {
+    }
+
+    void build(const Scene &scene) override
+    {
+        index_meshes(scene);
+        std::vector<uint32_t> all(scene.triangles.size());
+        std::vector<AxisAlignedBoundingBox> boxes(all.size());
+        for (uint32_t k = 0; k < all.size(); ++k)
+        {
+            all[k] = k;
+            boxes[k] = triangle_box(scene, k);
+        }
+        // built outside the arena so they are not grown there
+        std::vector<Node> nodes(1);
+        std::vector<uint32_t> refs;
+        build_node(nodes, refs, boxes, 0, m_bounds, all, 0);
+        m_nodes.assign(nodes.begin(), nodes.end());
+        m_refs.assign(refs.begin(), refs.end());
+    }
+
+    bool hit(const Scene &scene, const ray &r, const double t_min,
+             const double t_max, HitRecord &rec) const override
+    {
+        double t0 = t_min, t1 = t_max;
+        if (m_refs.empty() || !m_bounds.clip(r, t0, t1))
+            return false;
+
+        double best = t_max, t = t0, nudge = 0;
+        bool is_hit = false;
+        uint32_t last = 0;
+        while (true)
+        {
+            AxisAlignedBoundingBox box;
+            uint32_t leaf = locate(r, r.at(t + nudge), box);
+            if (leaf == last && nudge > 0 && nudge < 1e-3 * (1 + t))
+            {
+                // still in the leaf just left, through rounding
+                nudge *= 2;
+                continue;
+            }
+            ++ray_stats.box_tests;
+            const Node &n = m_nodes[leaf];
+            for (uint32_t j = n.first; j < n.first + n.count; ++j)
+                is_hit |= test(scene, m_refs[j], r, t_min, best, rec, is_hit);
+
+            double l0 = t, l1 = INF;
+            box.clip(r, l0, l1);
+            // as in the grid, a hit on the far side may tie with the next
+            // leaf
+            if (best < l1 || l1 >= t1)
+                break;
+            last = leaf;
+            t = l1;
+            nudge = 1e-12 * (1 + l1);
+        }
+        count_hit(is_hit, rec);
+        return is_hit;
+    }
+
+    size_t bytes() const override
+    {
+        return m_nodes.size() * sizeof(Node) +
+               m_refs.size() * sizeof(uint32_t) + object_bytes();
+    }
+
+    const char *name() const override { return "octree"; }
+
+private:
+    static const int LEAF_SIZE = 8, MAX_DEPTH = 10;
+
+    struct Node
+    {
+        // first of the 8 children, 0 for a leaf
+        uint32_t child;
+        // triangles of a leaf in m_refs
+        uint32_t first, count;
+    };
+
+    ArenaVector<Node> m_nodes;
+    ArenaVector<uint32_t> m_refs;
+
+    // child box 0-7 of box, bit a set for the upper half along axis a
+    static AxisAlignedBoundingBox octant(const AxisAlignedBoundingBox &box,
+                                         const int i)
+    {
+        point3 lo = box.min(), hi = box.max(), c = 0.5 * (lo + hi);
+        return AxisAlignedBoundingBox(
+            point3(i & 1 ? c.x : lo.x, i & 2 ? c.y : lo.y, i & 4 ? c.z : lo.z),
+            point3(i & 1 ? hi.x : c.x, i & 2 ? hi.y : c.y,
+                   i & 4 ? hi.z : c.z));
+    }
+
+    void build_node(std::vector<Node> &nodes, std::vector<uint32_t> &refs,
+                    const std::vector<AxisAlignedBoundingBox> &boxes,
+                    const uint32_t index, const AxisAlignedBoundingBox &box,
+                    const std::vector<uint32_t> &tris, const int depth)
+    {
+        std::vector<uint32_t> part[8];
+        bool split = tris.size() > size_t(LEAF_SIZE) && depth < MAX_DEPTH;
+        if (split)
+        {
+            // no point when every octant would get all triangles
+            bool progress = false;
+            for (int i = 0; i < 8; ++i)
+            {
+                AxisAlignedBoundingBox b = octant(box, i);
+                for (uint32_t k : tris)
+                    if (b.overlaps(boxes[k]))
+                        part[i].push_back(k);
+                progress |= part[i].size() < tris.size();
+            }
+            split = progress;
+        }
+        if (!split)
+        {
+            nodes[index] = {0, uint32_t(refs.size()), uint32_t(tris.size())};
+            refs.insert(refs.end(), tris.begin(), tris.end());
+            return;
+        }
+
+        uint32_t child = nodes.size();
+        nodes[index] = {child, 0, 0};
+        nodes.resize(nodes.size() + 8);
+        for (int i = 0; i < 8; ++i)
+        {
+            build_node(nodes, refs, boxes, child + i, octant(box, i), part[i],
+                       depth + 1);
+            part[i] = std::vector<uint32_t>();
+        }
+    }
+
+    // leaf containing p and its box, a point on a splitting plane goes to
+    // the side r moves towards
+    uint32_t locate(const ray &r, const point3 &p,
+                    AxisAlignedBoundingBox &box) const
+    {
+        uint32_t n = 0;
+        box = m_bounds;
+        while (m_nodes[n].child)
+        {
+            point3 c = 0.5 * (box.min() + box.max());
+            int i = 0;
+            for (int a = 0; a < 3; ++a)
+                if (p[a] > c[a] || (p[a] == c[a] && !r.sign(a)))
+                    i |= 1 << a;
+            n = m_nodes[n].child + i;
+            box = octant(box, i);
+        }
+        return n;
+    }
+};
+
+// the accelerator called name, nullptr for "linear"
+std::unique_ptr<Accelerator> make_accelerator(const std::string &name,
+                                              std::pmr::memory_resource *mr)
+{
+    if (name == "grid")
+        return std::make_unique<GridAccelerator>(mr);
+    if (name == "octree")
+        return std::make_unique<OctreeAccelerator>(mr);
+    return nullptr;
+}
+
+// applies the options of opt that change how a scene is built (welding,
+// spatial splits, accelerator and light cutoff), before it is loaded
+void configure_scene(Scene &scene, const Options &opt)
+{
+    scene.weld = opt.weld;
+    scene.sbvh = opt.sbvh;
+    scene.light_cutoff = opt.light_cutoff;
+    scene.accel = make_accelerator(opt.accel, scene.arena.resource());
+}
+
+#endif // ACCEL_H
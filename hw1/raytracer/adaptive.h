@@ -0,0 +1,181 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "render.h"
+#include "options.h"
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+struct DraftSample
+{
+    color c;
+    int object{-1};
+    int material{-1};
+    // 0: empty, 1: interpolated, 2: traced
+    char state{0};
+};
+
+// Samples of a draft render, one per pixel of the frame. Grid cells share
+// their corners and edges with the neighbouring cells, which read the
+// samples traced there instead of tracing them again.
+class DraftFrame
+{
+public:
+    DraftFrame(const Scene &scene, const double threshold)
+        : m_scene{scene}, m_nx{scene.camera.nx}, m_threshold{threshold},
+          m_samples(size_t(scene.camera.nx) * scene.camera.ny)
+    {
+    }
+
+    // refines the cell [ax,bx]x[ay,by] (inclusive), counting the rays it
+    // traces in traced. Cells running at the same time must not touch.
+    void refine(const int ax, const int ay, const int bx, const int by,
+                long &traced)
+    {
+        const DraftSample &c00 = sample(ax, ay, traced);
+        const DraftSample &c10 = sample(bx, ay, traced);
+        const DraftSample &c01 = sample(ax, by, traced);
+        const DraftSample &c11 = sample(bx, by, traced);
+
+        if (bx - ax <= 1 && by - ay <= 1)
+            return;
+
+        if (similar(c00, c10) && similar(c00, c01) && similar(c00, c11))
+        {
+            for (int j = ay; j <= by; ++j)
+            {
+                double fy = by > ay ? double(j - ay) / (by - ay) : 0;
+                for (int i = ax; i <= bx; ++i)
+                {
+                    DraftSample &s = at(i, j);
+                    if (s.state != 0)
+                        continue;
+                    double fx = bx > ax ? double(i - ax) / (bx - ax) : 0;
+                    s.c = (1 - fy) * ((1 - fx) * c00.c + fx * c10.c) +
+                          fy * ((1 - fx) * c01.c + fx * c11.c);
+                    s.object = c00.object;
+                    s.state = 1;
+                }
+            }
+            return;
+        }
+
+        int mx = (ax + bx) / 2;
+        int my = (ay + by) / 2;
+        refine(ax, ay, mx, my, traced);
+        refine(mx, ay, bx, my, traced);
+        refine(ax, my, mx, by, traced);
+        refine(mx, my, bx, by, traced);
+    }
+
+    void write(Image &img) const
+    {
+        for (size_t p = 0; p < m_samples.size(); ++p)
+            img.set_pixel(int(p % m_nx), int(p / m_nx), m_samples[p].c);
+    }
+
+private:
+    DraftSample &at(const int i, const int j)
+    {
+        return m_samples[size_t(j) * m_nx + i];
+    }
+
+    const DraftSample &sample(const int i, const int j, long &traced)
+    {
+        DraftSample &s = at(i, j);
+        if (s.state != 2)
+        {
+            HitRecord primary;
+            s.c = ray_color(m_scene, m_scene.camera.ray_to_pixel(i, j),
+                            MAX_DEPTH, &primary);
+            s.object = primary.object;
+            s.material = primary.material;
+            s.state = 2;
+            ++traced;
+        }
+        return s;
+    }
+
+    bool similar(const DraftSample &a, const DraftSample &b) const
+    {
+        if (a.object != b.object || a.material != b.material)
+            return false;
+        return fabs(clamp(a.c.x) - clamp(b.c.x)) <= m_threshold &&
+               fabs(clamp(a.c.y) - clamp(b.c.y)) <= m_threshold &&
+               fabs(clamp(a.c.z) - clamp(b.c.z)) <= m_threshold;
+    }
+
+    const Scene &m_scene;
+    int m_nx;
+    double m_threshold;
+    std::vector<DraftSample> m_samples;
+};
+
+void raytracing_draft(const Scene &scene, Image &img, const Options &opt)
+{
+    int nx = scene.camera.nx;
+    int ny = scene.camera.ny;
+    int bx = std::max(1, (nx - 2 + opt.draft_step) / opt.draft_step);
+    int by = std::max(1, (ny - 2 + opt.draft_step) / opt.draft_step);
+    std::atomic<long> traced{0};
+    DraftFrame frame(scene, opt.draft_threshold);
+
+    // cells only share pixels with their 8 neighbours, so the cells of one
+    // checkerboard colour (of four) are refined in parallel
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int colour = 0; colour < 4; ++colour)
+    {
+        int cx = (bx - colour % 2 + 1) / 2, cy = (by - colour / 2 + 1) / 2;
+        parallel_for(cx * cy, [&](const int b) {
+            int x0 = (2 * (b % cx) + colour % 2) * opt.draft_step;
+            int y0 = (2 * (b / cx) + colour / 2) * opt.draft_step;
+            int x1 = std::min(x0 + opt.draft_step, nx - 1);
+            int y1 = std::min(y0 + opt.draft_step, ny - 1);
+
+            long n = 0;
+            frame.refine(x0, y0, x1, y1, n);
+            traced += n;
+        });
+    }
+    frame.write(img);
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+
+    long total = long(scene.camera.nx) * scene.camera.ny;
+    std::cout << "Draft rendering is completed in "
+              << duration.count() / 1000.0 << " seconds.\n"
+              << "Traced " << traced << " primary rays for " << total
+              << " pixels (" << 100.0 * traced / total << "%).\n";
+
+    if (!opt.draft_error)
+        return;
+
+    Image full(scene.camera.nx, scene.camera.ny);
+    raytracing_threaded(scene, full);
+
+    double sq_err = 0;
+    int max_err = 0;
+    for (int j = 0; j < img.height(); ++j)
+    {
+        for (int i = 0; i < img.width(); ++i)
+        {
+            color a = img.get_pixel(i, j);
+            color b = full.get_pixel(i, j);
+            int d[3] = {clamp(a.x) - clamp(b.x), clamp(a.y) - clamp(b.y),
+                        clamp(a.z) - clamp(b.z)};
+            for (int k = 0; k < 3; ++k)
+            {
+                sq_err += d[k] * d[k];
+                max_err = std::max(max_err, std::abs(d[k]));
+            }
+        }
+    }
+    double rmse = sqrt(sq_err / (3.0 * total));
+    std::cout << "Draft error against full render: RMSE " << rmse
+              << ", PSNR "
+              << (rmse > 0 ? 20 * log10(255.0 / rmse) : INF)
+              << " dB, max channel error " << max_err << ".\n";
+}
+
+#endif // ADAPTIVE_H
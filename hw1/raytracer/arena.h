@@ -0,0 +1,59 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+#include <new>
+
+template <typename T>
+using ArenaVector = std::pmr::vector<T>;
+
+// Monotonic arena owning the data of one Scene. Containers allocate from
+// resource() by bumping a pointer through large chunks; nothing is freed
+// until the arena itself goes, which returns every chunk at once.
+class SceneArena
+{
+public:
+    SceneArena() : m_pool{FIRST_CHUNK, &m_upstream} {}
+    SceneArena(const SceneArena &) = delete;
+    SceneArena &operator=(const SceneArena &) = delete;
+
+    std::pmr::memory_resource *resource() { return &m_pool; }
+
+    // bytes taken from the heap so far
+    size_t bytes() const { return m_upstream.bytes; }
+
+private:
+    static const size_t FIRST_CHUNK = 64 * 1024;
+
+    // new/delete, counting what is handed out
+    struct CountingResource : std::pmr::memory_resource
+    {
+        size_t bytes{0};
+
+        void *do_allocate(size_t n, size_t align) override
+        {
+            bytes += n;
+            return ::operator new(n, std::align_val_t(align));
+        }
+
+        void do_deallocate(void *p, size_t n, size_t align) override
+        {
+            bytes -= n;
+            ::operator delete(p, n, std::align_val_t(align));
+        }
+
+        bool do_is_equal(
+            const std::pmr::memory_resource &other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    // declared first, the pool returns its chunks to it on destruction
+    CountingResource m_upstream;
+    std::pmr::monotonic_buffer_resource m_pool;
+};
+
+#endif // ARENA_H
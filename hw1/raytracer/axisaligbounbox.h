@@ -1,44 +1,187 @@
 #ifndef AXISALIGNEDBOUNDINGBOX_H
 #define AXISALIGNEDBOUNDINGBOX_H
 
-#include "hittable.h"
+#include "ray.h"
 #include "vec3.h"
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// slab distances use one rounded multiplication each, so the far distance
+// is scaled by 1 + 2 gamma(3) to never miss a box the ray touches
+static const double SLAB_ROBUST = 1 + 2 * 3 * 0x1p-53 / (1 - 3 * 0x1p-53);
+
+// max/min that keep acc when v is NaN (0 * inf, for a ray parallel to a
+// slab starting on its plane), which leaves that slab unbounded
+static inline double slab_max(const double v, const double acc)
+{
+    return v > acc ? v : acc;
+}
+static inline double slab_min(const double v, const double acc)
+{
+    return v < acc ? v : acc;
+}
 
 class AxisAlignedBoundingBox
 {
 public:
-    AxisAlignedBoundingBox() = default;
+    AxisAlignedBoundingBox()
+        : m_bounds{point3(INFINITY, INFINITY, INFINITY),
+                   point3(-INFINITY, -INFINITY, -INFINITY)}
+    {
+    }
 
     AxisAlignedBoundingBox(const point3 &minPoint, const point3 &maxPoint)
-        : m_minPoint{minPoint}, m_maxPoint{maxPoint}
+        : m_bounds{minPoint, maxPoint}
     {
     }
 
-    bool hit(const ray &r, const double &t_min,
-             const double &t_max) const
+    // Slab test with the inverse direction and sign bits of the ray: the
+    // near and far planes of every axis are picked without comparing, and
+    // the intervals are intersected without branches.
+    bool hit(const ray &r, const double &t_min, const double &t_max) const
     {
-        double min_diff[3], max_diff[3];
-        double min = t_min;
-        double max = t_max;
+        double t0 = t_min, t1 = t_max;
+        return clip(r, t0, t1);
+    }
 
-        for (int a = 0; a < 3; a++)
-        {
-            min_diff[a] = (m_minPoint[a] - r.origin()[a]) / r.direction()[a];
-            max_diff[a] = (m_maxPoint[a] - r.origin()[a]) / r.direction()[a];
-        }
-        for (int a = 0; a < 3; a++)
+    // the same test for n rays against this box, hits[k] for rays[k]
+    void hit(const ray *rays, const size_t n, const double t_min,
+             const double t_max, uint8_t *hits) const
+    {
+        const point3 lo = m_bounds[0], hi = m_bounds[1];
+#pragma omp simd
+        for (size_t k = 0; k < n; ++k)
         {
-            min = fmax(fmin(min_diff[a], max_diff[a]), t_min);
-            max = fmin(fmax(min_diff[a], max_diff[a]), t_max);
-            if (max <= min)
-                return false;
+            const point3 o = rays[k].origin();
+            const vec3 &inv = rays[k].inv_direction();
+            double t0 = t_min, t1 = t_max;
+            double ax = (lo.x - o.x) * inv.x, bx = (hi.x - o.x) * inv.x;
+            double ay = (lo.y - o.y) * inv.y, by = (hi.y - o.y) * inv.y;
+            double az = (lo.z - o.z) * inv.z, bz = (hi.z - o.z) * inv.z;
+            t0 = slab_max(ax < bx ? ax : bx, t0);
+            t0 = slab_max(ay < by ? ay : by, t0);
+            t0 = slab_max(az < bz ? az : bz, t0);
+            t1 = slab_min((ax < bx ? bx : ax) * SLAB_ROBUST, t1);
+            t1 = slab_min((ay < by ? by : ay) * SLAB_ROBUST, t1);
+            t1 = slab_min((az < bz ? bz : az) * SLAB_ROBUST, t1);
+            hits[k] = t0 <= t1;
         }
-        return true;
+    }
+
+    const point3 &min() const { return m_bounds[0]; }
+    const point3 &max() const { return m_bounds[1]; }
+
+    bool overlaps(const AxisAlignedBoundingBox &b) const
+    {
+        const point3 &lo = min(), &hi = max();
+        return lo.x <= b.max().x && b.min().x <= hi.x && lo.y <= b.max().y &&
+               b.min().y <= hi.y && lo.z <= b.max().z && b.min().z <= hi.z;
+    }
+
+    bool contains(const AxisAlignedBoundingBox &b) const
+    {
+        const point3 &lo = min(), &hi = max();
+        return lo.x <= b.min().x && b.max().x <= hi.x && lo.y <= b.min().y &&
+               b.max().y <= hi.y && lo.z <= b.min().z && b.max().z <= hi.z;
+    }
+
+    void expand(const point3 &p)
+    {
+        point3 &lo = m_bounds[0], &hi = m_bounds[1];
+        lo = point3(fmin(lo.x, p.x), fmin(lo.y, p.y), fmin(lo.z, p.z));
+        hi = point3(fmax(hi.x, p.x), fmax(hi.y, p.y), fmax(hi.z, p.z));
+    }
+
+    void expand(const AxisAlignedBoundingBox &b)
+    {
+        expand(b.min());
+        expand(b.max());
+    }
+
+    // narrows [t0, t1] to the part of r inside the box, false when empty
+    bool clip(const ray &r, double &t0, double &t1) const
+    {
+        const point3 o = r.origin();
+        const vec3 &inv = r.inv_direction();
+        t0 = slab_max((m_bounds[r.sign(0)].x - o.x) * inv.x, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(0)].x - o.x) * inv.x * SLAB_ROBUST,
+                      t1);
+        t0 = slab_max((m_bounds[r.sign(1)].y - o.y) * inv.y, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(1)].y - o.y) * inv.y * SLAB_ROBUST,
+                      t1);
+        t0 = slab_max((m_bounds[r.sign(2)].z - o.z) * inv.z, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(2)].z - o.z) * inv.z * SLAB_ROBUST,
+                      t1);
+        return t0 <= t1;
+    }
+
+    // distance along r at which it leaves the box, 0 when it misses it
+    double exit_distance(const ray &r) const
+    {
+        const point3 o = r.origin();
+        const vec3 &inv = r.inv_direction();
+        double t0 = 0, t1 = std::numeric_limits<double>::infinity();
+        t0 = slab_max((m_bounds[r.sign(0)].x - o.x) * inv.x, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(0)].x - o.x) * inv.x, t1);
+        t0 = slab_max((m_bounds[r.sign(1)].y - o.y) * inv.y, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(1)].y - o.y) * inv.y, t1);
+        t0 = slab_max((m_bounds[r.sign(2)].z - o.z) * inv.z, t0);
+        t1 = slab_min((m_bounds[1 - r.sign(2)].z - o.z) * inv.z, t1);
+        return t0 <= t1 ? t1 : 0;
     }
 
 private:
-    point3 m_minPoint;
-    point3 m_maxPoint;
+    // min and max corner, indexed by the sign bits of a ray
+    point3 m_bounds[2];
 };
 
+// Boxes stored per corner and axis, for testing many boxes against one ray:
+// the sign bits of the ray select whole arrays, so the loop has no gathers
+// or branches and vectorises.
+struct BoxArray
+{
+    // bound[0] min corners, bound[1] max corners, per axis
+    std::vector<double> bound[2][3];
+
+    size_t size() const { return bound[0][0].size(); }
+
+    void add(const AxisAlignedBoundingBox &b)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            bound[0][a].push_back(b.min()[a]);
+            bound[1][a].push_back(b.max()[a]);
+        }
+    }
+
+    // hits[k] is set when r enters box k within (t_min, t_max)
+    void hit(const ray &r, const double t_min, const double t_max,
+             uint8_t *hits) const
+    {
+        const point3 o = r.origin();
+        const vec3 &inv = r.inv_direction();
+        const double *nx = bound[r.sign(0)][0].data();
+        const double *ny = bound[r.sign(1)][1].data();
+        const double *nz = bound[r.sign(2)][2].data();
+        const double *fx = bound[1 - r.sign(0)][0].data();
+        const double *fy = bound[1 - r.sign(1)][1].data();
+        const double *fz = bound[1 - r.sign(2)][2].data();
+        const size_t n = size();
+#pragma omp simd
+        for (size_t k = 0; k < n; ++k)
+        {
+            double t0 = t_min, t1 = t_max;
+            t0 = slab_max((nx[k] - o.x) * inv.x, t0);
+            t0 = slab_max((ny[k] - o.y) * inv.y, t0);
+            t0 = slab_max((nz[k] - o.z) * inv.z, t0);
+            t1 = slab_min((fx[k] - o.x) * inv.x * SLAB_ROBUST, t1);
+            t1 = slab_min((fy[k] - o.y) * inv.y * SLAB_ROBUST, t1);
+            t1 = slab_min((fz[k] - o.z) * inv.z * SLAB_ROBUST, t1);
+            hits[k] = t0 <= t1;
+        }
+    }
+};
 #endif // AXISALIGNEDBOUNDINGBOX_H
\ No newline at end of file
@@ -0,0 +1,401 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "accel.h"
+#include "raster.h"
+#include "render.h"
+#include "options.h"
+#include "xml.h"
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Splits every triangle of the scene into 4^levels triangles through edge
+// midpoints. The image stays the same while the triangle count grows.
+// Fails on a face referring to a missing vertex.
+bool subdivide_scene_xml(const std::string &xml, const int levels,
+                         std::string &result)
+{
+    result = xml;
+    xml_document doc;
+    doc.load_buffer(xml.data(), xml.size(), parse_trim_pcdata);
+    xml_node sc = doc.child("scene");
+    if (levels <= 0 || !sc)
+        return true;
+
+    vector<point3> vertices = str_to_vv3(sc.child_value("vertexdata"));
+    const int file_vertices = int(vertices.size());
+    map<pair<int, int>, int> midpoints;
+    auto midpoint = [&](int a, int b) {
+        pair<int, int> key = a < b ? make_pair(a, b) : make_pair(b, a);
+        auto it = midpoints.find(key);
+        if (it != midpoints.end())
+            return it->second;
+        vertices.push_back(0.5 * (vertices[a - 1] + vertices[b - 1]));
+        return midpoints[key] = vertices.size();
+    };
+
+    for (auto o : sc.child("objects").children("mesh"))
+    {
+        vector<int> faces = tokenize_int(o.child_value("faces"));
+        for (int f : faces)
+        {
+            if (f < 1 || f > file_vertices)
+            {
+                cerr << "XML error: " << o.attribute("id").value()
+                     << ".faces refers to a missing vertex" << endl;
+                return false;
+            }
+        }
+        for (int l = 0; l < levels; ++l)
+        {
+            vector<int> split;
+            for (size_t j = 0; j + 2 < faces.size(); j += 3)
+            {
+                int a = faces[j], b = faces[j + 1], c = faces[j + 2];
+                int ab = midpoint(a, b), bc = midpoint(b, c),
+                    ca = midpoint(c, a);
+                int tris[] = {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca};
+                split.insert(split.end(), tris, tris + 12);
+            }
+            faces.swap(split);
+        }
+
+        ostringstream ss;
+        for (size_t j = 0; j < faces.size(); ++j)
+            ss << faces[j] << (j % 3 == 2 ? '\n' : ' ');
+        o.child("faces").text().set(ss.str().c_str());
+    }
+
+    ostringstream ss;
+    ss.precision(17);
+    for (auto &v : vertices)
+        ss << v << '\n';
+    sc.child("vertexdata").text().set(ss.str().c_str());
+
+    ostringstream out;
+    doc.save(out);
+    result = out.str();
+    return true;
+}
+
+struct BenchResult
+{
+    std::string scene;
+    int subdivision, threads, nx, ny;
+    size_t triangles;
+    // accelerator and its memory
+    std::string accel;
+    size_t accel_bytes;
+    // spatial split budget of the mesh BVHs (negative: object splits), and
+    // the size and SAH cost of the result
+    double sbvh;
+    size_t bvh_nodes, bvh_references;
+    double bvh_sah;
+    double parse_s, build_s, render_s, export_s;
+    RayStats stats;
+    // hardware counters per phase, the render phase also per worker thread
+    PerfCounts parse_perf, build_perf, render_perf, export_perf;
+    std::vector<PerfCounts> thread_perf;
+};
+
+static PerfCounts perf_delta(const PerfCounts &from, const PerfCounts &to)
+{
+    PerfCounts d = to;
+    for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+        d.v[e] -= from.v[e];
+    return d;
+}
+
+static double seconds_since(
+    const std::chrono::high_resolution_clock::time_point &start)
+{
+    return std::chrono::duration<double>(
+               std::chrono::high_resolution_clock::now() - start)
+        .count();
+}
+
+// measures one run into res, false when the scene does not parse
+bool bench_run(const std::string &name, const std::string &xml,
+               const int subdivision, const unsigned int threads,
+               const std::string &accel, const double sbvh,
+               const Options &opt, BenchResult &res)
+{
+    res = BenchResult{name, subdivision, int(threads)};
+    res.accel = accel;
+    res.sbvh = sbvh;
+
+    // parse, build and export run on this thread, render on the workers
+    PerfCounters perf;
+    if (perf_enabled)
+        perf.open();
+    PerfCounts mark = perf.read();
+    auto phase_perf = [&]() {
+        PerfCounts now = perf.read();
+        PerfCounts d = perf_delta(mark, now);
+        mark = now;
+        return d;
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    Scene scene;
+    scene.accel = make_accelerator(accel, scene.arena.resource());
+    if (!scene_from_xml_buffer(scene, xml, false))
+        return false;
+    res.parse_s = seconds_since(start);
+    res.parse_perf = phase_perf();
+
+    render_threads = threads;
+    start = std::chrono::high_resolution_clock::now();
+    scene.sbvh = sbvh;
+    scene.light_cutoff = opt.light_cutoff;
+    scene.build();
+    res.build_s = seconds_since(start);
+    res.bvh_nodes = scene.bvh_nodes.size();
+    res.bvh_references = scene.triangles.size();
+    res.bvh_sah = scene.bvh_sah;
+    res.accel_bytes = scene.accel ? scene.accel->bytes()
+                                  : res.bvh_nodes * sizeof(BVHNode);
+    res.build_perf = phase_perf();
+
+    if (opt.bench_nx > 0)
+    {
+        scene.camera.nx = opt.bench_nx;
+        scene.camera.ny = opt.bench_ny;
+    }
+    res.nx = scene.camera.nx;
+    res.ny = scene.camera.ny;
+    res.triangles = scene.primitive_count();
+
+    Image img(scene.camera.nx, scene.camera.ny);
+    stats_total.take();
+    perf_total.take();
+    phase_perf();
+    start = std::chrono::high_resolution_clock::now();
+    if (opt.raster)
+        raytracing_raster(scene, img);
+    else
+        raytracing_threaded(scene, img);
+    res.render_s = seconds_since(start);
+    res.stats = stats_total.take();
+    // the render phase is counted by the workers; this thread only waits
+    phase_perf();
+    res.thread_perf = perf_total.take();
+    for (auto &t : res.thread_perf)
+        res.render_perf.add(t);
+
+    start = std::chrono::high_resolution_clock::now();
+    std::ostringstream out;
+    img.export_ppm(out);
+    res.export_s = seconds_since(start);
+    res.export_perf = phase_perf();
+
+    render_threads = 0;
+    return true;
+}
+
+// {"cycles": n, ...} with the events that could be opened, divided by per
+static void perf_json(std::ostream &out, const PerfCounts &c,
+                      const double per = 1)
+{
+    out << "{";
+    bool first = true;
+    for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+    {
+        if (!c.valid[e])
+            continue;
+        out << (first ? "" : ", ") << "\"" << perf_event_names[e] << "\": ";
+        if (per == 1)
+            out << c.v[e];
+        else
+            out << c.v[e] / per;
+        first = false;
+    }
+    out << "}";
+}
+
+void bench_json(std::ostream &out, const std::vector<BenchResult> &results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &r = results[i];
+        const RayStats &s = r.stats;
+        double rays = s.rays() ? double(s.rays()) : 1.0;
+        out << "  {\"scene\": \"" << r.scene << "\", \"subdivision\": "
+            << r.subdivision << ", \"threads\": " << r.threads
+            << ", \"resolution\": [" << r.nx << ", " << r.ny
+            << "], \"triangles\": " << r.triangles << ",\n"
+            << "   \"accel\": {\"name\": \"" << r.accel
+            << "\", \"bytes\": " << r.accel_bytes << "},\n"
+            << "   \"bvh\": {\"spatial_splits\": "
+            << (r.sbvh >= 0 ? "true" : "false")
+            << ", \"nodes\": " << r.bvh_nodes
+            << ", \"triangle_references\": " << r.bvh_references
+            << ", \"sah\": " << r.bvh_sah << "},\n"
+            << "   \"phases_s\": {\"parse\": " << r.parse_s
+            << ", \"build\": " << r.build_s << ", \"render\": " << r.render_s
+            << ", \"export\": " << r.export_s << "},\n"
+            << "   \"rays\": {\"primary\": " << s.primary
+            << ", \"shadow\": " << s.shadow
+            << ", \"reflection\": " << s.reflection
+            << "}, \"lights_culled\": " << s.lights_culled << ",\n"
+            << "   \"shadow_cache\": {\"tests\": " << s.shadow_cache_tests
+            << ", \"hits\": " << s.shadow_cache_hits << ", \"hit_rate\": "
+            << (s.shadow_cache_tests
+                    ? double(s.shadow_cache_hits) / s.shadow_cache_tests
+                    : 0.0)
+            << "},\n"
+            << "   \"primary_cache\": {\"tests\": " << s.primary_cache_tests
+            << ", \"hits\": " << s.primary_cache_hits << ", \"hit_rate\": "
+            << (s.primary_cache_tests
+                    ? double(s.primary_cache_hits) / s.primary_cache_tests
+                    : 0.0)
+            << "},\n"
+            << "   \"rays_per_s\": {\"primary\": " << s.primary / r.render_s
+            << ", \"shadow\": " << s.shadow / r.render_s
+            << ", \"reflection\": " << s.reflection / r.render_s
+            << ", \"total\": " << s.rays() / r.render_s << "},\n"
+            << "   \"triangle_tests_per_ray\": " << s.triangle_tests / rays
+            << ", \"shape_tests_per_ray\": " << s.shape_tests / rays
+            << ", \"node_visits_per_ray\": " << s.box_tests / rays;
+        if (r.render_perf.any())
+        {
+            out << ",\n   \"perf\": {\"parse\": ";
+            perf_json(out, r.parse_perf);
+            out << ", \"build\": ";
+            perf_json(out, r.build_perf);
+            out << ", \"render\": ";
+            perf_json(out, r.render_perf);
+            out << ", \"export\": ";
+            perf_json(out, r.export_perf);
+            out << ",\n            \"render_per_ray\": ";
+            perf_json(out, r.render_perf, rays);
+            out << ",\n            \"render_threads\": [";
+            for (size_t t = 0; t < r.thread_perf.size(); ++t)
+            {
+                out << (t ? ", " : "");
+                perf_json(out, r.thread_perf[t]);
+            }
+            out << "]}";
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+// Renders every bench scene at every subdivision level and thread count,
+// with every --bench-accel accelerator (linear with object split BVHs and
+// with --sbvh also spatial split ones), and writes the measurements as
+// JSON to opt.bench_json (or stdout). Scenes that do not parse are skipped.
+int run_benchmark(const Options &opt)
+{
+    // stdout only carries the JSON when it is written there
+    render_quiet = opt.bench_json.empty();
+    std::vector<unsigned int> threads = opt.bench_threads;
+    if (threads.empty())
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        n = n ? n : 1;
+        for (unsigned int t = 1; t < n; t *= 2)
+            threads.push_back(t);
+        threads.push_back(n);
+    }
+
+    if (opt.bench_perf)
+    {
+        PerfCounters probe;
+        perf_enabled = probe.open();
+        if (!perf_enabled)
+            std::cerr << "perf counters unavailable ("
+                      << std::strerror(probe.error())
+                      << "), benchmarking without them" << std::endl;
+    }
+
+    // accelerator and BVH spatial split budget of every run
+    std::vector<std::pair<std::string, double>> builds;
+    for (const std::string &accel : opt.bench_accels)
+    {
+        builds.emplace_back(accel, -1);
+        if (accel == "linear" && opt.sbvh >= 0)
+            builds.emplace_back(accel, opt.sbvh);
+    }
+
+    std::vector<BenchResult> results;
+    for (auto &path : opt.bench_scenes)
+    {
+        std::ifstream in{path, std::ios::in | std::ios::binary};
+        if (!in.is_open())
+        {
+            std::cerr << "Error: cannot open bench scene " << path
+                      << std::endl;
+            return -1;
+        }
+        std::stringstream ss;
+        ss << in.rdbuf();
+
+        bool parsed = true;
+        for (size_t l = 0; l < opt.bench_subdivisions.size() && parsed; ++l)
+        {
+            int level = opt.bench_subdivisions[l];
+            std::string xml;
+            if (!subdivide_scene_xml(ss.str(), level, xml))
+            {
+                std::cerr << "Error: cannot subdivide bench scene " << path
+                          << ", skipping it" << std::endl;
+                parsed = false;
+                break;
+            }
+            for (size_t k = 0; k < threads.size() && parsed; ++k)
+            {
+                unsigned int t = threads[k];
+                for (auto &[accel, sbvh] : builds)
+                {
+                    BenchResult r;
+                    if (!bench_run(path, xml, level, t, accel, sbvh, opt, r))
+                    {
+                        std::cerr << "Error: cannot parse bench scene "
+                                  << path << ", skipping it" << std::endl;
+                        parsed = false;
+                        break;
+                    }
+                    results.push_back(r);
+                    std::cerr << "bench " << path << " subdiv " << level
+                              << " (" << r.triangles << " triangles), " << t
+                              << " threads, ";
+                    if (accel != "linear")
+                        std::cerr << accel << " " << r.accel_bytes
+                                  << " bytes";
+                    else
+                        std::cerr << (sbvh >= 0 ? "SBVH " : "BVH ")
+                                  << r.bvh_nodes << " nodes, SAH "
+                                  << r.bvh_sah;
+                    std::cerr << ": " << r.render_s << " s, "
+                              << r.stats.rays() / r.render_s << " rays/s";
+                    if (r.render_perf.valid[PERF_INSTRUCTIONS] &&
+                        r.render_perf.valid[PERF_CYCLES])
+                        std::cerr
+                            << ", IPC "
+                            << double(r.render_perf.v[PERF_INSTRUCTIONS]) /
+                                   r.render_perf.v[PERF_CYCLES];
+                    std::cerr << std::endl;
+                }
+            }
+        }
+    }
+
+    if (opt.bench_json.empty())
+    {
+        bench_json(std::cout, results);
+        return 0;
+    }
+    std::ofstream out{opt.bench_json, std::ios::out};
+    bench_json(out, results);
+    return out.good() ? 0 : -1;
+}
+
+#endif // BENCH_H
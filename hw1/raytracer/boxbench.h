@@ -0,0 +1,126 @@
+#ifndef BOXBENCH_H
+#define BOXBENCH_H
+
+#include "axisaligbounbox.h"
+#include "options.h"
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// The box test before rays carried their inverse direction: six divisions,
+// and the slabs are only checked one at a time against [t_min, t_max]
+// instead of against each other, so it accepts boxes the ray passes by.
+static bool legacy_box_hit(const AxisAlignedBoundingBox &box, const ray &r,
+                           const double &t_min, const double &t_max)
+{
+    double min_diff[3], max_diff[3];
+    double min = t_min;
+    double max = t_max;
+
+    for (int a = 0; a < 3; a++)
+    {
+        min_diff[a] = (box.min()[a] - r.origin()[a]) / r.direction()[a];
+        max_diff[a] = (box.max()[a] - r.origin()[a]) / r.direction()[a];
+    }
+    for (int a = 0; a < 3; a++)
+    {
+        min = fmax(fmin(min_diff[a], max_diff[a]), t_min);
+        max = fmin(fmax(min_diff[a], max_diff[a]), t_max);
+        if (max < min)
+            return false;
+    }
+    return true;
+}
+
+// Tests opt.bench_boxes random boxes against random rays with the legacy
+// test and the three forms of the slab test, and prints the time per test
+// and how often the legacy test disagrees with the slab test.
+int run_box_benchmark(const Options &opt)
+{
+    const size_t n_boxes = opt.bench_boxes, n_rays = 4096;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> pos(-1, 1), size(0.02, 0.3);
+
+    std::vector<AxisAlignedBoundingBox> boxes;
+    BoxArray box_array;
+    for (size_t k = 0; k < n_boxes; ++k)
+    {
+        point3 lo(pos(rng), pos(rng), pos(rng));
+        boxes.emplace_back(lo, lo + vec3(size(rng), size(rng), size(rng)));
+        box_array.add(boxes.back());
+    }
+    // from outside the cube towards a point inside it
+    std::vector<ray> rays;
+    for (size_t k = 0; k < n_rays; ++k)
+    {
+        point3 o(3 * pos(rng), 3 * pos(rng), 3 * pos(rng));
+        point3 to(pos(rng), pos(rng), pos(rng));
+        rays.emplace_back(o, to - o);
+    }
+
+    // results ray by ray, or box by box for by_box
+    std::vector<uint8_t> expected(n_boxes * n_rays), got(n_boxes * n_rays);
+    auto run = [&](const char *name, auto test, const bool by_box = false) {
+        auto start = std::chrono::high_resolution_clock::now();
+        test(got.data());
+        double s = std::chrono::duration<double>(
+                       std::chrono::high_resolution_clock::now() - start)
+                       .count();
+        size_t hits = 0, differ = 0;
+        for (size_t j = 0; j < n_rays; ++j)
+        {
+            for (size_t k = 0; k < n_boxes; ++k)
+            {
+                uint8_t h = by_box ? got[k * n_rays + j] : got[j * n_boxes + k];
+                hits += h;
+                differ += h != expected[j * n_boxes + k];
+            }
+        }
+        std::cout << std::left << std::setw(22) << name << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(10)
+                  << 1e9 * s / got.size() << std::setw(12) << hits
+                  << std::setw(12) << differ << "\n"
+                  << std::defaultfloat;
+    };
+
+    // the scalar slab test is the reference the others are compared to
+    for (size_t j = 0; j < n_rays; ++j)
+        for (size_t k = 0; k < n_boxes; ++k)
+            expected[j * n_boxes + k] = boxes[k].hit(rays[j], 0, INF);
+
+    std::cout << n_boxes << " boxes x " << n_rays << " rays\n"
+              << std::left << std::setw(22) << "test" << std::right
+              << std::setw(10) << "ns/test" << std::setw(12) << "hits"
+              << std::setw(12) << "differ" << "\n";
+    run("legacy", [&](uint8_t *hits) {
+        for (size_t j = 0; j < n_rays; ++j)
+            for (size_t k = 0; k < n_boxes; ++k)
+                hits[j * n_boxes + k] =
+                    legacy_box_hit(boxes[k], rays[j], 0, INF);
+    });
+    run("slab", [&](uint8_t *hits) {
+        for (size_t j = 0; j < n_rays; ++j)
+            for (size_t k = 0; k < n_boxes; ++k)
+                hits[j * n_boxes + k] = boxes[k].hit(rays[j], 0, INF);
+    });
+    run("slab many boxes", [&](uint8_t *hits) {
+        for (size_t j = 0; j < n_rays; ++j)
+            box_array.hit(rays[j], 0, INF, hits + j * n_boxes);
+    });
+    // packets of 64 rays, like the primary rays of a few tile rows
+    run(
+        "slab many rays",
+        [&](uint8_t *hits) {
+            for (size_t p = 0; p < n_rays; p += 64)
+                for (size_t k = 0; k < n_boxes; ++k)
+                    boxes[k].hit(&rays[p], 64, 0, INF,
+                                 hits + k * n_rays + p);
+        },
+        true);
+    return 0;
+}
+
+#endif // BOXBENCH_H
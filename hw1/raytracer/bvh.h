@@ -0,0 +1,525 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "axisaligbounbox.h"
+#include "hittable.h"
+#include "mesh.h"
+#include "ray.h"
+#include "stats.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Wide bounding volume hierarchy over the triangles of one mesh. Every node
+// holds up to BVH_WIDTH children whose boxes are stored as 8-bit offsets
+// from a float origin in steps of a power of two per axis, rounded outwards
+// so a child box never shrinks. One ray is tested against all children of
+// a node in a loop the compiler vectorises, with the near and far planes
+// picked by the sign bits of the ray like AxisAlignedBoundingBox::hit.
+
+static const int BVH_WIDTH = 4;
+// triangles in a leaf
+static const int BVH_LEAF_SIZE = 4;
+
+struct alignas(64) BVHNode
+{
+    // child box corner = origin + q * 2^exponent, per axis
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t children;
+    // min and max planes, read as one block of 6 * BVH_WIDTH bytes
+    uint8_t lo[3][BVH_WIDTH], hi[3][BVH_WIDTH];
+    // node index, or first triangle of a leaf (relative to the mesh)
+    uint32_t child[BVH_WIDTH];
+    // triangles of a leaf child, 0 for an inner node
+    uint8_t leaf_count[BVH_WIDTH];
+};
+
+static_assert(sizeof(BVHNode) == 64, "BVHNode should fill one cache line");
+
+// 2^e as a float, for the exponents the builder produces
+static inline float exp2_float(const int e)
+{
+    uint32_t bits = uint32_t(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Builds the BVH of one mesh top down with a binned surface area heuristic.
+// With spatial >= 0 it also considers spatial splits (SBVH): a triangle
+// straddling the split plane is referenced on both sides, clipped to each,
+// while the duplicates stay within spatial times the triangle count. They
+// pay off on large triangles whose boxes overlap, like walls and floors.
+class BVHBuilder
+{
+public:
+    BVHBuilder(const Vertex *pos, const Triangle *tris, const uint32_t n,
+               std::vector<BVHNode> &nodes, const double spatial = -1)
+        : m_pos{pos}, m_tris{tris}, m_n{n}, m_nodes{nodes},
+          m_spatial{spatial}
+    {
+    }
+
+    // builds the tree, appends the triangles of its leaves to leaves (some
+    // twice with spatial splits) and returns the index of its root
+    uint32_t build(std::vector<Triangle> &leaves)
+    {
+        std::vector<Ref> refs(m_n);
+        for (uint32_t j = 0; j < m_n; ++j)
+            refs[j] = {j, triangle_bounds(m_pos, &m_tris[j], 1)};
+        AxisAlignedBoundingBox box = bounds(refs);
+        m_root_area = area(box);
+        m_max_duplicates = m_spatial > 0 ? size_t(m_spatial * m_n) : 0;
+
+        m_leaves = &leaves;
+        m_base = leaves.size();
+        return build_node(refs);
+    }
+
+    // expected cost of a ray hitting the root, one unit per node visit and
+    // per triangle test
+    double sah() const
+    {
+        return m_root_area > 0 ? m_sah / m_root_area : 0;
+    }
+
+    size_t duplicates() const { return m_duplicates; }
+
+private:
+    static const int BINS = 12, SPATIAL_BINS = 16;
+    // overlap of the object split children, relative to the root, above
+    // which spatial splits are tried
+    static constexpr double SPATIAL_OVERLAP = 1e-5;
+
+    // a triangle, or the part of it inside box
+    struct Ref
+    {
+        uint32_t tri;
+        AxisAlignedBoundingBox box;
+    };
+
+    static AxisAlignedBoundingBox bounds(const std::vector<Ref> &refs)
+    {
+        AxisAlignedBoundingBox box;
+        for (const Ref &r : refs)
+            box.expand(r.box);
+        return box;
+    }
+
+    static double area(const AxisAlignedBoundingBox &b)
+    {
+        vec3 e = b.max() - b.min();
+        if (!(e.x >= 0 && e.y >= 0 && e.z >= 0))
+            return 0;
+        return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+
+    static AxisAlignedBoundingBox overlap(const AxisAlignedBoundingBox &a,
+                                          const AxisAlignedBoundingBox &b)
+    {
+        return AxisAlignedBoundingBox(
+            point3(fmax(a.min().x, b.min().x), fmax(a.min().y, b.min().y),
+                   fmax(a.min().z, b.min().z)),
+            point3(fmin(a.max().x, b.max().x), fmin(a.max().y, b.max().y),
+                   fmin(a.max().z, b.max().z)));
+    }
+
+    static point3 centroid(const Ref &r)
+    {
+        return 0.5 * (r.box.min() + r.box.max());
+    }
+
+    // bounds of the part of the triangle of r between lo and hi on axis a
+    AxisAlignedBoundingBox clip(const Ref &r, const int a, const double lo,
+                                const double hi) const
+    {
+        const Triangle &t = m_tris[r.tri];
+        point3 v[3] = {m_pos[t.v0].point(), m_pos[t.v1].point(),
+                       m_pos[t.v2].point()};
+        AxisAlignedBoundingBox box;
+        for (int i = 0; i < 3; ++i)
+        {
+            const point3 &p = v[i], &q = v[(i + 1) % 3];
+            if (p[a] >= lo && p[a] <= hi)
+                box.expand(p);
+            for (double plane : {lo, hi})
+                if ((p[a] < plane && plane < q[a]) ||
+                    (q[a] < plane && plane < p[a]))
+                    box.expand(p + (plane - p[a]) / (q[a] - p[a]) * (q - p));
+        }
+        double mn[3] = {-INF, -INF, -INF}, mx[3] = {INF, INF, INF};
+        mn[a] = lo;
+        mx[a] = hi;
+        AxisAlignedBoundingBox slab(point3(mn[0], mn[1], mn[2]),
+                                    point3(mx[0], mx[1], mx[2]));
+        return overlap(overlap(box, r.box), slab);
+    }
+
+    int object_bin(const double c, const double lo, const double ext) const
+    {
+        return std::min(BINS - 1, int(BINS * (c - lo) / ext));
+    }
+
+    // moves the right part of refs to right. Object splits partition the
+    // centroids, spatial splits cut the node box; in the middle when
+    // neither separates them.
+    void split(std::vector<Ref> &refs, std::vector<Ref> &right)
+    {
+        AxisAlignedBoundingBox cbox;
+        for (const Ref &r : refs)
+            cbox.expand(centroid(r));
+
+        double best_cost = INF;
+        int best_axis = -1, best_bin = 0;
+        AxisAlignedBoundingBox best_left, best_right;
+        for (int a = 0; a < 3; ++a)
+        {
+            double lo = cbox.min()[a], ext = cbox.max()[a] - lo;
+            if (!(ext > 0))
+                continue;
+            AxisAlignedBoundingBox bin_box[BINS];
+            uint32_t bin_count[BINS] = {};
+            for (const Ref &r : refs)
+            {
+                int b = object_bin(centroid(r)[a], lo, ext);
+                bin_box[b].expand(r.box);
+                ++bin_count[b];
+            }
+            // cost of splitting before bin b, summed from both ends
+            AxisAlignedBoundingBox left_box[BINS];
+            uint32_t left_count[BINS];
+            AxisAlignedBoundingBox acc;
+            uint32_t n = 0;
+            for (int b = 0; b < BINS - 1; ++b)
+            {
+                acc.expand(bin_box[b]);
+                n += bin_count[b];
+                left_box[b] = acc;
+                left_count[b] = n;
+            }
+            acc = AxisAlignedBoundingBox();
+            n = 0;
+            for (int b = BINS - 1; b > 0; --b)
+            {
+                acc.expand(bin_box[b]);
+                n += bin_count[b];
+                double cost =
+                    area(left_box[b - 1]) * left_count[b - 1] + area(acc) * n;
+                if (left_count[b - 1] && n && cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_bin = b;
+                    best_left = left_box[b - 1];
+                    best_right = acc;
+                }
+            }
+        }
+
+        if (m_duplicates < m_max_duplicates &&
+            (best_axis < 0 || area(overlap(best_left, best_right)) >
+                                  SPATIAL_OVERLAP * m_root_area) &&
+            spatial_split(refs, right, best_cost))
+            return;
+
+        auto mid = refs.begin() + refs.size() / 2;
+        if (best_axis >= 0)
+        {
+            double lo = cbox.min()[best_axis];
+            double ext = cbox.max()[best_axis] - lo;
+            mid = std::partition(refs.begin(), refs.end(), [&](const Ref &r) {
+                return object_bin(centroid(r)[best_axis], lo, ext) < best_bin;
+            });
+        }
+        right.assign(mid, refs.end());
+        refs.erase(mid, refs.end());
+    }
+
+    // splits refs at the best plane of SPATIAL_BINS per axis across their
+    // box when that beats cost and stays within the duplicate budget
+    bool spatial_split(std::vector<Ref> &refs, std::vector<Ref> &right,
+                       const double cost)
+    {
+        AxisAlignedBoundingBox box = bounds(refs);
+        double best_cost = cost, best_plane = 0;
+        int best_axis = -1;
+        for (int a = 0; a < 3; ++a)
+        {
+            double lo = box.min()[a], w = (box.max()[a] - lo) / SPATIAL_BINS;
+            if (!(w > 0))
+                continue;
+            auto bin = [&](const double x) {
+                return std::max(0, std::min(SPATIAL_BINS - 1,
+                                            int((x - lo) / w)));
+            };
+            AxisAlignedBoundingBox bin_box[SPATIAL_BINS];
+            uint32_t entry[SPATIAL_BINS] = {}, exit[SPATIAL_BINS] = {};
+            for (const Ref &r : refs)
+            {
+                int b0 = bin(r.box.min()[a]), b1 = bin(r.box.max()[a]);
+                ++entry[b0];
+                ++exit[b1];
+                if (b0 == b1)
+                    bin_box[b0].expand(r.box);
+                else
+                    for (int b = b0; b <= b1; ++b)
+                        bin_box[b].expand(
+                            clip(r, a, lo + b * w, lo + (b + 1) * w));
+            }
+
+            AxisAlignedBoundingBox left_box[SPATIAL_BINS];
+            uint32_t left_count[SPATIAL_BINS];
+            AxisAlignedBoundingBox acc;
+            uint32_t n = 0;
+            for (int b = 0; b < SPATIAL_BINS - 1; ++b)
+            {
+                acc.expand(bin_box[b]);
+                n += entry[b];
+                left_box[b] = acc;
+                left_count[b] = n;
+            }
+            acc = AxisAlignedBoundingBox();
+            n = 0;
+            for (int b = SPATIAL_BINS - 1; b > 0; --b)
+            {
+                acc.expand(bin_box[b]);
+                n += exit[b];
+                size_t dup = left_count[b - 1] + n - refs.size();
+                double c =
+                    area(left_box[b - 1]) * left_count[b - 1] + area(acc) * n;
+                if (left_count[b - 1] && n && c < best_cost &&
+                    m_duplicates + dup <= m_max_duplicates &&
+                    left_count[b - 1] < refs.size() && n < refs.size())
+                {
+                    best_cost = c;
+                    best_axis = a;
+                    best_plane = lo + b * w;
+                }
+            }
+        }
+        if (best_axis < 0)
+            return false;
+
+        std::vector<Ref> left;
+        for (const Ref &r : refs)
+        {
+            if (r.box.max()[best_axis] <= best_plane)
+                left.push_back(r);
+            else if (r.box.min()[best_axis] >= best_plane)
+                right.push_back(r);
+            else
+            {
+                left.push_back({r.tri, clip(r, best_axis, -INF, best_plane)});
+                right.push_back({r.tri, clip(r, best_axis, best_plane, INF)});
+                ++m_duplicates;
+            }
+        }
+        refs.swap(left);
+        return true;
+    }
+
+    uint32_t build_node(std::vector<Ref> &refs)
+    {
+        // open the largest group until the node is full
+        std::vector<std::vector<Ref>> groups(1);
+        groups[0].swap(refs);
+        while (groups.size() < size_t(BVH_WIDTH))
+        {
+            int k = -1;
+            for (size_t g = 0; g < groups.size(); ++g)
+                if (groups[g].size() > size_t(BVH_LEAF_SIZE) &&
+                    (k < 0 || groups[g].size() > groups[k].size()))
+                    k = g;
+            if (k < 0)
+                break;
+            std::vector<Ref> right;
+            split(groups[k], right);
+            groups.push_back(std::move(right));
+        }
+
+        uint32_t index = m_nodes.size();
+        m_nodes.emplace_back();
+        AxisAlignedBoundingBox box;
+        AxisAlignedBoundingBox child_box[BVH_WIDTH];
+        uint32_t child[BVH_WIDTH];
+        uint8_t leaf_count[BVH_WIDTH] = {};
+        for (size_t g = 0; g < groups.size(); ++g)
+        {
+            child_box[g] = bounds(groups[g]);
+            box.expand(child_box[g]);
+            if (groups[g].size() <= size_t(BVH_LEAF_SIZE))
+            {
+                child[g] = m_leaves->size() - m_base;
+                leaf_count[g] = groups[g].size();
+                for (const Ref &r : groups[g])
+                    m_leaves->push_back(m_tris[r.tri]);
+                m_sah += area(child_box[g]) * groups[g].size();
+            }
+            else
+            {
+                child[g] = build_node(groups[g]);
+            }
+        }
+        m_sah += area(box);
+
+        // m_nodes may have grown, fill the node in afterwards
+        BVHNode &node = m_nodes[index];
+        node.children = groups.size();
+        for (int a = 0; a < 3; ++a)
+        {
+            // origin at or below the minimum, the smallest power of two
+            // step that reaches the maximum in 255 steps
+            float origin = float(box.min()[a]);
+            if (origin > box.min()[a])
+                origin = std::nextafter(origin, -INFINITY);
+            double ext = box.max()[a] - origin;
+            int e = ext > 0 ? std::ilogb(ext / 255) : -100;
+            e = std::max(-100, e);
+            while (origin + 255 * std::ldexp(1.0, e) < box.max()[a])
+                ++e;
+            double step = std::ldexp(1.0, e);
+
+            node.origin[a] = origin;
+            node.exponent[a] = e;
+            for (int l = 0; l < BVH_WIDTH; ++l)
+            {
+                node.lo[a][l] = node.hi[a][l] = 0;
+                if (l >= node.children)
+                    continue;
+                double q_lo = (child_box[l].min()[a] - origin) / step;
+                double q_hi = (child_box[l].max()[a] - origin) / step;
+                node.lo[a][l] = std::max(0.0, std::floor(q_lo));
+                node.hi[a][l] = std::min(255.0, std::ceil(q_hi));
+            }
+        }
+        for (int l = 0; l < BVH_WIDTH; ++l)
+        {
+            node.child[l] = l < node.children ? child[l] : 0;
+            node.leaf_count[l] = leaf_count[l];
+        }
+        return index;
+    }
+
+    const Vertex *m_pos;
+    const Triangle *m_tris;
+    uint32_t m_n;
+    std::vector<BVHNode> &m_nodes;
+    double m_spatial;
+    std::vector<Triangle> *m_leaves{nullptr};
+    size_t m_base{0};
+    double m_root_area{0}, m_sah{0};
+    size_t m_duplicates{0}, m_max_duplicates{0};
+};
+
+// closest hit of r with the triangles under root, like hit_triangles over
+// the whole mesh (rec.primitive indexes tris)
+static bool hit_bvh(const BVHNode *nodes, const uint32_t root,
+                    const Vertex *pos, const Triangle *tris, const ray &r,
+                    const double t_min, const double t_max, HitRecord &rec)
+{
+    // the float slab distances are off by a few ulps relative to their size
+    static const float SLACK = 1e-5f;
+
+    struct Entry
+    {
+        uint32_t ref, count;
+        float t;
+    };
+    Entry stack[128];
+    int top = 0;
+    stack[top++] = {root, 0, 0};
+
+    const point3 o = r.origin();
+    const vec3 &inv = r.inv_direction();
+    const float ix = inv.x, iy = inv.y, iz = inv.z;
+
+    double best = t_max;
+    bool is_hit = false;
+    HitRecord temp;
+    while (top > 0)
+    {
+        Entry e = stack[--top];
+        if (e.t > best * (1 + SLACK))
+            continue;
+        if (e.count)
+        {
+            ray_stats.triangle_tests += e.count;
+            if (hit_triangles(pos, tris + e.ref, e.count, r, t_min, best,
+                              temp))
+            {
+                best = temp.t;
+                rec = temp;
+                rec.primitive += e.ref;
+                is_hit = true;
+            }
+            continue;
+        }
+
+        const BVHNode &n = nodes[e.ref];
+        ray_stats.box_tests += n.children;
+
+        // widen the 24 quantized planes first, 4 byte lanes do not vectorise
+        float q[2][3][BVH_WIDTH];
+        const uint8_t *bytes = &n.lo[0][0];
+#pragma omp simd
+        for (int k = 0; k < 6 * BVH_WIDTH; ++k)
+            (&q[0][0][0])[k] = bytes[k];
+
+        // near and far planes per axis, picked by the signs of the ray
+        const float *nx = q[r.sign(0)][0], *fx = q[1 - r.sign(0)][0];
+        const float *ny = q[r.sign(1)][1], *fy = q[1 - r.sign(1)][1];
+        const float *nz = q[r.sign(2)][2], *fz = q[1 - r.sign(2)][2];
+        const float dx = float(double(n.origin[0]) - o.x);
+        const float dy = float(double(n.origin[1]) - o.y);
+        const float dz = float(double(n.origin[2]) - o.z);
+        const float sx = exp2_float(n.exponent[0]);
+        const float sy = exp2_float(n.exponent[1]);
+        const float sz = exp2_float(n.exponent[2]);
+        const int children = n.children;
+
+        float near[BVH_WIDTH];
+        int hit[BVH_WIDTH];
+        const float lo_t = float(t_min), hi_t = float(best) * (1 + SLACK);
+#pragma omp simd
+        for (int l = 0; l < BVH_WIDTH; ++l)
+        {
+            // NaN (origin on the face of a flat slab) leaves t0, t1 alone
+            float t0 = lo_t, t1 = hi_t, t;
+            t = (dx + nx[l] * sx) * ix;
+            t0 = t > t0 ? t : t0;
+            t = (dy + ny[l] * sy) * iy;
+            t0 = t > t0 ? t : t0;
+            t = (dz + nz[l] * sz) * iz;
+            t0 = t > t0 ? t : t0;
+            t = (dx + fx[l] * sx) * ix * (1 + SLACK);
+            t1 = t < t1 ? t : t1;
+            t = (dy + fy[l] * sy) * iy * (1 + SLACK);
+            t1 = t < t1 ? t : t1;
+            t = (dz + fz[l] * sz) * iz * (1 + SLACK);
+            t1 = t < t1 ? t : t1;
+            near[l] = t0;
+            hit[l] = (l < children) & (t0 <= t1);
+        }
+
+        // push the hit children farthest first so the nearest is next
+        int order[BVH_WIDTH], m = 0;
+        for (int l = 0; l < BVH_WIDTH; ++l)
+        {
+            if (!hit[l])
+                continue;
+            int k = m++;
+            for (; k > 0 && near[order[k - 1]] < near[l]; --k)
+                order[k] = order[k - 1];
+            order[k] = l;
+        }
+        for (int k = 0; k < m; ++k)
+            stack[top++] = {n.child[order[k]], n.leaf_count[order[k]],
+                            near[order[k]]};
+    }
+    return is_hit;
+}
+
+#endif // BVH_H
@@ -1,5 +1,6 @@
 #include "vec3.h"
 #include "ray.h"
+#include "helpers.h"
 
 struct Camera
 {
@@ -19,4 +20,13 @@ struct Camera
 
         return ray(position, s - position);
     }
+
+    uint64_t hash() const
+    {
+        const double values[] = {position.x, position.y, position.z,
+                                 u.x, u.y, u.z, v.x, v.y, v.z, w.x, w.y, w.z,
+                                 np_l, np_r, np_t, np_b, near_dist,
+                                 double(nx), double(ny)};
+        return hash_bytes(values, sizeof(values));
+    }
 };
\ No newline at end of file
@@ -0,0 +1,233 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "render.h"
+#include "options.h"
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Periodically saves finished tiles of a long render next to its output:
+// <output>.ckpt holds the pixels of finished tiles, appended in the order
+// they were flushed, and <output>.ckpt.manifest records how many bytes of
+// it are complete. Workers only append the tile index to the front buffer;
+// a background thread swaps it with the back buffer and does the I/O.
+class Checkpoint
+{
+public:
+    Checkpoint(const Scene &scene, const Image &img, const std::string &path,
+               const int interval)
+        : m_scene{scene}, m_img{img}, m_grid{scene.camera},
+          m_data_path{path + ".ckpt"},
+          m_manifest_path{path + ".ckpt.manifest"}, m_interval{interval}
+    {
+    }
+
+    ~Checkpoint()
+    {
+        stop();
+        if (m_data)
+            fclose(m_data);
+    }
+
+    // restores the tiles of a previous run into img, returns the mask of
+    // tiles that still have to be rendered
+    std::vector<char> resume(Image &img)
+    {
+        std::vector<char> todo(m_grid.count(), 1);
+        long bytes = 0;
+        if (!read_manifest(bytes))
+        {
+            std::cout << "No matching checkpoint, rendering all tiles.\n";
+            return todo;
+        }
+
+        FILE *in = fopen(m_data_path.c_str(), "rb");
+        long pos = 0;
+        int32_t header[2];
+        std::vector<color> pixels;
+        while (in && pos < bytes && fread(header, sizeof(header), 1, in) == 1)
+        {
+            int k = header[0];
+            if (k < 0 || k >= m_grid.count())
+                break;
+            pixels.resize(header[1]);
+            if (fread(pixels.data(), sizeof(color), pixels.size(), in) !=
+                pixels.size())
+                break;
+
+            int x0, y0, x1, y1;
+            m_grid.bounds(k, x0, y0, x1, y1);
+            for (int j = y0, p = 0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    img.set_pixel(i, j, pixels[p++]);
+            todo[k] = 0;
+            pos += sizeof(header) + pixels.size() * sizeof(color);
+            m_done.push_back(k);
+        }
+        if (in)
+            fclose(in);
+
+        // drop whatever was written after the last manifest update
+        if (truncate(m_data_path.c_str(), pos) != 0)
+            pos = 0;
+        m_bytes = pos;
+        std::cout << "Resuming: " << m_done.size() << " of "
+                  << m_grid.count() << " tiles restored from checkpoint.\n";
+        return todo;
+    }
+
+    void start()
+    {
+        m_data = fopen(m_data_path.c_str(), m_bytes > 0 ? "ab" : "wb");
+        if (!m_data)
+        {
+            std::cerr << "Error: Checkpoint " << m_data_path
+                      << " cannot be opened." << std::endl;
+            return;
+        }
+        m_writer = std::thread(&Checkpoint::writer, this);
+    }
+
+    void stop()
+    {
+        if (!m_writer.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_writer.join();
+    }
+
+    // called by the workers, never blocks on I/O
+    void tile_done(const int k)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_front.push_back(k);
+    }
+
+private:
+    void writer()
+    {
+        std::vector<int> back;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            bool stopping = m_wake.wait_for(
+                lock, std::chrono::seconds(m_interval),
+                [this]() { return m_stop; });
+            std::swap(m_front, back);
+            lock.unlock();
+
+            flush(back);
+            back.clear();
+
+            lock.lock();
+            if (stopping)
+                return;
+        }
+    }
+
+    void flush(const std::vector<int> &tiles)
+    {
+        if (tiles.empty())
+            return;
+
+        std::vector<color> pixels;
+        for (int k : tiles)
+        {
+            int x0, y0, x1, y1;
+            m_grid.bounds(k, x0, y0, x1, y1);
+            pixels.clear();
+            for (int j = y0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    pixels.push_back(m_img.get_pixel(i, j));
+
+            int32_t header[2] = {k, int32_t(pixels.size())};
+            fwrite(header, sizeof(header), 1, m_data);
+            fwrite(pixels.data(), sizeof(color), pixels.size(), m_data);
+            m_bytes += sizeof(header) + pixels.size() * sizeof(color);
+            m_done.push_back(k);
+        }
+        fflush(m_data);
+        fsync(fileno(m_data));
+        write_manifest();
+    }
+
+    void write_manifest() const
+    {
+        std::string tmp = m_manifest_path + ".tmp";
+        {
+            std::ofstream out{tmp, std::ios::out};
+            out << "rtckpt 1\n"
+                << m_scene.source_hash << ' ' << m_grid.nx << ' '
+                << m_grid.ny << ' ' << m_grid.size << '\n'
+                << m_bytes << ' ' << m_done.size() << '\n';
+        }
+        std::rename(tmp.c_str(), m_manifest_path.c_str());
+    }
+
+    bool read_manifest(long &bytes) const
+    {
+        std::ifstream in{m_manifest_path, std::ios::in};
+        std::string magic;
+        int version = 0, nx = 0, ny = 0, size = 0;
+        uint64_t hash = 0;
+        size_t n_done = 0;
+        if (!(in >> magic >> version >> hash >> nx >> ny >> size >> bytes >>
+              n_done))
+            return false;
+        return magic == "rtckpt" && version == 1 &&
+               hash == m_scene.source_hash && nx == m_grid.nx &&
+               ny == m_grid.ny && size == m_grid.size;
+    }
+
+    const Scene &m_scene;
+    const Image &m_img;
+    TileGrid m_grid;
+    std::string m_data_path, m_manifest_path;
+    int m_interval;
+
+    FILE *m_data{nullptr};
+    long m_bytes{0};
+    std::vector<int> m_done;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::vector<int> m_front;
+    bool m_stop{false};
+    std::thread m_writer;
+};
+
+// called once the final output is written
+void remove_checkpoint(const std::string &output_path)
+{
+    std::remove((output_path + ".ckpt").c_str());
+    std::remove((output_path + ".ckpt.manifest").c_str());
+}
+
+// Renders scene into img while checkpointing finished tiles every
+// opt.checkpoint_interval seconds, skipping the tiles of an earlier
+// checkpoint when opt.resume is set.
+void raytracing_checkpointed(const Scene &scene, Image &img,
+                             const Options &opt)
+{
+    Checkpoint ckpt(scene, img, opt.output_path, opt.checkpoint_interval);
+    std::vector<char> todo(TileGrid(scene.camera).count(), 1);
+    if (opt.resume)
+        todo = ckpt.resume(img);
+
+    ckpt.start();
+    raytracing_threaded(scene, img, &todo, nullptr,
+                        [&ckpt](const int k) { ckpt.tile_done(k); });
+    ckpt.stop();
+}
+
+#endif // CHECKPOINT_H
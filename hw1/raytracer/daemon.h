@@ -0,0 +1,420 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "accel.h"
+#include "render.h"
+#include "net.h"
+#include "options.h"
+#include "xml.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+// Parsed scenes kept in memory between jobs, keyed by the hash of their
+// file so an edited file is loaded again. Least recently used scenes are
+// dropped once more than capacity are cached. Scenes are built with the
+// scene options the daemon was started with (--weld, --accel, ...).
+// get runs on the render thread while stats connections read the counts,
+// so the entries and counters are guarded by the cache's own mutex; a
+// returned scene is used outside of it.
+class SceneCache
+{
+public:
+    SceneCache(const size_t capacity, const Options &opt)
+        : m_capacity{capacity}, m_opt{opt}
+    {
+    }
+
+    // the scene is parsed without holding the lock
+    std::shared_ptr<Scene> get(const std::string &path)
+    {
+        uint64_t key = hash_file(path.c_str());
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_index.find(key);
+            if (it != m_index.end())
+            {
+                ++m_counts.hits;
+                m_lru.splice(m_lru.begin(), m_lru, it->second);
+                return it->second->second;
+            }
+            ++m_counts.misses;
+        }
+
+        auto scene = std::make_shared<Scene>();
+        configure_scene(*scene, m_opt);
+        if (!scene_from_xml_file(*scene, path.c_str()))
+            return nullptr;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_lru.emplace_front(key, scene);
+        m_index[key] = m_lru.begin();
+        while (m_lru.size() > m_capacity)
+        {
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+            ++m_counts.evictions;
+        }
+        return scene;
+    }
+
+    struct Counts
+    {
+        // cached scenes and the heap held by their arenas
+        size_t size{0}, bytes{0};
+        long hits{0}, misses{0}, evictions{0};
+    };
+
+    Counts counts() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Counts c = m_counts;
+        c.size = m_lru.size();
+        for (auto &e : m_lru)
+            c.bytes += e.second->arena.bytes();
+        return c;
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<Scene>>;
+    size_t m_capacity;
+    Options m_opt;
+    mutable std::mutex m_mutex;
+    Counts m_counts;
+    std::list<Entry> m_lru;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> m_index;
+};
+
+// applies "key=value" camera overrides of a job, vectors are comma separated
+static bool override_camera(Camera &cam, const std::string &arg)
+{
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string key = arg.substr(0, eq);
+    std::string value = arg.substr(eq + 1);
+    std::replace(value.begin(), value.end(), ',', ' ');
+    std::replace(value.begin(), value.end(), 'x', ' ');
+    std::vector<double> v = tokenize(value.c_str());
+
+    if (key == "position" && v.size() == 3)
+        cam.position = v_to_v3(v);
+    else if (key == "gaze" && v.size() == 3)
+        cam.w = -v_to_v3(v);
+    else if (key == "up" && v.size() == 3)
+        cam.v = v_to_v3(v);
+    else if (key == "nearplane" && v.size() == 4)
+    {
+        cam.np_l = v[0];
+        cam.np_r = v[1];
+        cam.np_b = v[2];
+        cam.np_t = v[3];
+    }
+    else if (key == "neardistance" && v.size() == 1)
+        cam.near_dist = v[0];
+    else if (key == "resolution" && v.size() == 2 && v[0] >= 1 &&
+             v[1] >= 1 && v[0] * v[1] <= MAX_IMAGE_PIXELS)
+    {
+        cam.nx = v[0];
+        cam.ny = v[1];
+    }
+    else
+        return false;
+
+    cam.u = cross(cam.v, cam.w);
+    return true;
+}
+
+struct DaemonJob
+{
+    std::string scene_path, output_path;
+    std::vector<std::string> overrides;
+    std::chrono::high_resolution_clock::time_point queued;
+    std::promise<std::string> reply;
+};
+
+// Latency samples of the last completed jobs, in seconds
+class LatencyWindow
+{
+public:
+    void add(const double s)
+    {
+        m_samples.push_back(s);
+        if (m_samples.size() > 1000)
+            m_samples.pop_front();
+    }
+
+    std::string summary() const
+    {
+        if (m_samples.empty())
+            return "n/a";
+        std::vector<double> v(m_samples.begin(), m_samples.end());
+        std::sort(v.begin(), v.end());
+        double sum = 0;
+        for (double s : v)
+            sum += s;
+        std::ostringstream ss;
+        ss << "mean " << sum / v.size() << " p50 " << v[v.size() / 2]
+           << " p95 " << v[v.size() * 95 / 100] << " max " << v.back();
+        return ss.str();
+    }
+
+private:
+    std::deque<double> m_samples;
+};
+
+// Render daemon: accepts one request line per connection,
+//   render <scene> <output> [position=x,y,z gaze=.. up=.. nearplane=l,r,b,t
+//                            neardistance=d resolution=WxH]
+//   stats
+//   shutdown
+// Jobs are rendered one at a time with all threads, in arrival order.
+class RenderDaemon
+{
+public:
+    explicit RenderDaemon(const Options &opt)
+        : m_cache{size_t(opt.cache_size), opt}
+    {
+    }
+
+    int run(const std::string &endpoint)
+    {
+        Endpoint ep;
+        ep.parse(endpoint);
+        int listener = listen_on(ep);
+        if (listener < 0)
+        {
+            std::cerr << "Error: cannot listen on " << endpoint << ": "
+                      << strerror(errno) << std::endl;
+            return -1;
+        }
+        std::cout << "Render daemon listening on "
+                  << bound_endpoint(ep, listener).str() << "\n";
+
+        std::thread renderer(&RenderDaemon::render_loop, this);
+        while (!stopping())
+        {
+            pollfd pfd{listener, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0)
+                std::thread(&RenderDaemon::serve, this, fd).detach();
+        }
+        renderer.join();
+        close(listener);
+        if (ep.unix_socket)
+            unlink(ep.path.c_str());
+        return 0;
+    }
+
+private:
+    bool stopping()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_stop;
+    }
+
+    void serve(const int fd)
+    {
+        std::string line;
+        char c;
+        while (recv(fd, &c, 1, 0) == 1 && c != '\n')
+            line += c;
+
+        std::istringstream in{line};
+        std::string cmd;
+        in >> cmd;
+        std::string reply;
+        if (cmd == "render")
+        {
+            auto job = std::make_shared<DaemonJob>();
+            std::string arg;
+            in >> job->scene_path >> job->output_path;
+            while (in >> arg)
+                job->overrides.push_back(arg);
+            std::future<std::string> result = job->reply.get_future();
+            submit(job);
+            reply = result.get();
+        }
+        else if (cmd == "stats")
+            reply = stats();
+        else if (cmd == "shutdown")
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            reply = "ok shutting down";
+        }
+        else
+            reply = "error unknown command";
+
+        reply += '\n';
+        send_all(fd, reply.data(), reply.size());
+        close(fd);
+    }
+
+    void submit(const std::shared_ptr<DaemonJob> &job)
+    {
+        job->queued = std::chrono::high_resolution_clock::now();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop)
+        {
+            job->reply.set_value("error daemon is shutting down");
+            return;
+        }
+        m_queue.push_back(job);
+        m_max_queue = std::max(m_max_queue, m_queue.size());
+        m_wake.notify_one();
+    }
+
+    void render_loop()
+    {
+        while (true)
+        {
+            std::shared_ptr<DaemonJob> job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock,
+                            [this]() { return m_stop || !m_queue.empty(); });
+                if (m_queue.empty())
+                    return;
+                job = m_queue.front();
+                m_queue.pop_front();
+            }
+
+            auto start = std::chrono::high_resolution_clock::now();
+            // a malformed job fails on its own without taking the daemon
+            // down
+            std::string reply;
+            try
+            {
+                reply = render(*job);
+            }
+            catch (const std::exception &e)
+            {
+                reply = std::string("error ") + e.what();
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_wait.add(std::chrono::duration<double>(start - job->queued)
+                           .count());
+            m_latency.add(
+                std::chrono::duration<double>(end - job->queued).count());
+            ++(reply.compare(0, 2, "ok") == 0 ? m_done : m_failed);
+            job->reply.set_value(reply);
+        }
+    }
+
+    std::string render(const DaemonJob &job)
+    {
+        std::shared_ptr<Scene> scene = m_cache.get(job.scene_path);
+        if (!scene)
+            return "error cannot load " + job.scene_path;
+
+        // the cache owns the scene and only this thread renders, so the
+        // camera is overridden in place and restored on every way out,
+        // including an exception
+        struct RestoreCamera
+        {
+            Camera &camera;
+            const Camera saved;
+            ~RestoreCamera() { camera = saved; }
+        } restore{scene->camera, scene->camera};
+        for (auto &o : job.overrides)
+            if (!override_camera(scene->camera, o))
+                return "error bad camera override " + o;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        Image img(scene->camera.nx, scene->camera.ny);
+        raytracing_threaded(*scene, img);
+
+        std::ofstream out{job.output_path, std::ios::out};
+        if (!out.is_open())
+            return "error cannot write " + job.output_path;
+        img.export_ppm(out);
+
+        std::ostringstream ss;
+        ss << "ok " << job.output_path << ' '
+           << std::chrono::duration<double>(
+                  std::chrono::high_resolution_clock::now() - start)
+                  .count();
+        return ss.str();
+    }
+
+    std::string stats()
+    {
+        SceneCache::Counts cache = m_cache.counts();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ostringstream ss;
+        ss << "ok queue " << m_queue.size() << " max_queue " << m_max_queue
+           << " done " << m_done << " failed " << m_failed << " cached "
+           << cache.size << " cache_bytes " << cache.bytes << " cache_hits "
+           << cache.hits << " cache_misses " << cache.misses
+           << " evictions " << cache.evictions << " | wait "
+           << m_wait.summary()
+           << " | latency " << m_latency.summary();
+        return ss.str();
+    }
+
+    SceneCache m_cache;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::shared_ptr<DaemonJob>> m_queue;
+    size_t m_max_queue{0};
+    long m_done{0}, m_failed{0};
+    LatencyWindow m_wait, m_latency;
+    bool m_stop{false};
+};
+
+// sends one request line to a daemon and prints its reply
+int submit_to_daemon(const Options &opt)
+{
+    Endpoint ep;
+    ep.parse(opt.submit);
+    int fd = connect_to(ep);
+    if (fd < 0)
+    {
+        std::cerr << "Error: cannot connect to " << opt.submit << std::endl;
+        return -1;
+    }
+
+    // the daemon resolves paths against its own working directory
+    char cwd[4096];
+    std::string base = getcwd(cwd, sizeof(cwd)) ? std::string(cwd) + "/" : "";
+    auto absolute = [&base](const std::string &p) {
+        return p.empty() || p[0] == '/' ? p : base + p;
+    };
+    std::string line = opt.scene_path.empty()
+                           ? "stats\n"
+                           : "render " + absolute(opt.scene_path) + " " +
+                                 absolute(opt.output_path);
+    for (auto &o : opt.camera_overrides)
+        line += " " + o;
+    if (line.back() != '\n')
+        line += '\n';
+    send_all(fd, line.data(), line.size());
+
+    std::string reply;
+    char c;
+    while (recv(fd, &c, 1, 0) == 1 && c != '\n')
+        reply += c;
+    close(fd);
+    std::cout << reply << std::endl;
+    return reply.compare(0, 2, "ok") == 0 ? 0 : -1;
+}
+
+#endif // DAEMON_H
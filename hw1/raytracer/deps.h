@@ -0,0 +1,193 @@
+#ifndef DEPS_H
+#define DEPS_H
+
+#include "axisaligbounbox.h"
+#include "hittable.h"
+#include "scene.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// What the rays of one tile touched in a previous run: the objects they
+// hit (including shadow blockers), the materials and lights used for
+// shading, and the world-space bounds of every ray segment. Escaping rays
+// are clipped to the scene bounds and flagged.
+struct TileRecord
+{
+    std::vector<std::string> objects, materials, lights;
+    AxisAlignedBoundingBox footprint;
+    bool escaped{false};
+};
+
+static std::string light_key(const Scene &scene, const int index)
+{
+    const std::string &id = scene.lights[index].id;
+    return id.empty() ? "#" + std::to_string(index) : id;
+}
+
+static AxisAlignedBoundingBox scene_bounds(const Scene &scene)
+{
+    AxisAlignedBoundingBox bounds;
+    // planes are unbounded, rays that only hit them still count as escaping
+    for (auto &o : scene.objects)
+        if (o.type != PRIMITIVE_PLANE)
+            bounds.expand(o.box);
+    return bounds;
+}
+
+// Scene data shared by the recorders of all tiles of one render
+struct DepsContext
+{
+    const Scene &scene;
+    AxisAlignedBoundingBox bounds;
+
+    explicit DepsContext(const Scene &sc) : scene{sc}, bounds{scene_bounds(sc)}
+    {
+    }
+};
+
+// Collects the TileRecord of one tile while a worker renders it. Workers
+// install their recorder in tile_deps so ray_color can report to it.
+class DepsRecorder
+{
+public:
+    explicit DepsRecorder(const DepsContext &ctx) : m_ctx{ctx} {}
+
+    void object(const int o) { m_objects.insert(o); }
+
+    void material(const std::string &id) { m_materials.insert(id); }
+
+    void light(const int index) { m_lights.insert(index); }
+
+    void segment(const point3 &a, const point3 &b)
+    {
+        m_rec.footprint.expand(a);
+        m_rec.footprint.expand(b);
+    }
+
+    void escaped(const ray &r)
+    {
+        m_rec.escaped = true;
+        segment(r.origin(), r.at(m_ctx.bounds.exit_distance(r)));
+    }
+
+    TileRecord finish()
+    {
+        for (auto o : m_objects)
+            m_rec.objects.push_back(m_ctx.scene.object_ids[o]);
+        m_rec.materials.assign(m_materials.begin(), m_materials.end());
+        for (int l : m_lights)
+            m_rec.lights.push_back(light_key(m_ctx.scene, l));
+        std::sort(m_rec.objects.begin(), m_rec.objects.end());
+        std::sort(m_rec.materials.begin(), m_rec.materials.end());
+        std::sort(m_rec.lights.begin(), m_rec.lights.end());
+        return m_rec;
+    }
+
+private:
+    const DepsContext &m_ctx;
+    std::unordered_set<int> m_objects;
+    std::unordered_set<std::string> m_materials;
+    std::unordered_set<int> m_lights;
+    TileRecord m_rec;
+};
+
+static thread_local DepsRecorder *tile_deps = nullptr;
+
+struct DepsFile
+{
+    int tile_size{0}, nx{0}, ny{0};
+    AxisAlignedBoundingBox scene_bounds;
+    std::vector<TileRecord> tiles;
+
+    bool save(const std::string &path) const
+    {
+        std::ofstream out{path, std::ios::out};
+        if (!out.is_open())
+            return false;
+
+        out << "rtdeps 1\n"
+            << tile_size << ' ' << nx << ' ' << ny << ' ' << tiles.size()
+            << '\n'
+            << box_str(scene_bounds) << '\n';
+        for (auto &t : tiles)
+        {
+            out << box_str(t.footprint) << ' ' << t.escaped << '\n';
+            write_ids(out, t.objects);
+            write_ids(out, t.materials);
+            write_ids(out, t.lights);
+        }
+        return out.good();
+    }
+
+    bool load(const std::string &path)
+    {
+        std::ifstream in{path, std::ios::in};
+        std::string magic;
+        int version = 0;
+        size_t n_tiles = 0;
+        if (!(in >> magic >> version) || magic != "rtdeps" || version != 1)
+            return false;
+
+        in >> tile_size >> nx >> ny >> n_tiles;
+        scene_bounds = read_box(in);
+        tiles.resize(n_tiles);
+        for (auto &t : tiles)
+        {
+            t.footprint = read_box(in);
+            in >> t.escaped;
+            read_ids(in, t.objects);
+            read_ids(in, t.materials);
+            read_ids(in, t.lights);
+        }
+        return bool(in);
+    }
+
+private:
+    static void write_ids(std::ostream &out,
+                          const std::vector<std::string> &ids)
+    {
+        out << ids.size();
+        for (auto &id : ids)
+            out << ' ' << id;
+        out << '\n';
+    }
+
+    static void read_ids(std::istream &in, std::vector<std::string> &ids)
+    {
+        size_t n = 0;
+        in >> n;
+        ids.resize(n);
+        for (auto &id : ids)
+            in >> id;
+    }
+
+    static std::string box_str(const AxisAlignedBoundingBox &b)
+    {
+        if (b.min().x > b.max().x)
+            return "empty";
+        std::ostringstream ss;
+        ss.precision(17);
+        ss << b.min() << ' ' << b.max();
+        return ss.str();
+    }
+
+    static AxisAlignedBoundingBox read_box(std::istream &in)
+    {
+        if (in >> std::ws && in.peek() == 'e')
+        {
+            std::string empty;
+            in >> empty;
+            return AxisAlignedBoundingBox();
+        }
+        point3 lo, hi;
+        in >> lo.x >> lo.y >> lo.z >> hi.x >> hi.y >> hi.z;
+        return AxisAlignedBoundingBox(lo, hi);
+    }
+};
+
+#endif // DEPS_H
@@ -0,0 +1,380 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "accel.h"
+#include "render.h"
+#include "net.h"
+#include "options.h"
+#include "xml.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <sys/wait.h>
+#include <thread>
+
+enum : uint32_t
+{
+    MSG_SCENE = 1, // scene XML
+    MSG_TILES = 2, // int32 tile indices to render
+    MSG_TILE = 3,  // int32 tile index followed by its pixels
+    MSG_BYE = 4,
+    MSG_OPTIONS = 5, // scene_args of the coordinator, one per line
+};
+
+static const int TILES_PER_REQUEST = 4;
+
+// Hands out tiles to the connected workers. Once no tile is pending, idle
+// workers get copies of tiles still in flight elsewhere so a straggling or
+// dead worker cannot hold up the frame; the first result wins.
+class TileScheduler
+{
+public:
+    explicit TileScheduler(const int count)
+        : m_issued(count, 0), m_done(count, 0), m_remaining{count}
+    {
+        for (int k = 0; k < count; ++k)
+            m_pending.push_back(k);
+    }
+
+    // blocks until there is work or the frame is finished (empty result)
+    std::vector<int> next()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            std::vector<int> batch;
+            while (!m_pending.empty() && batch.size() < TILES_PER_REQUEST)
+            {
+                int k = m_pending.front();
+                m_pending.pop_front();
+                if (!m_done[k])
+                    batch.push_back(k);
+            }
+            for (size_t k = 0; k < m_done.size() && m_pending.empty() &&
+                               batch.size() < TILES_PER_REQUEST;
+                 ++k)
+            {
+                if (!m_done[k] && m_issued[k] == 1)
+                {
+                    batch.push_back(k);
+                    ++m_reissued;
+                }
+            }
+            for (int k : batch)
+                ++m_issued[k];
+            if (!batch.empty() || m_remaining == 0)
+                return batch;
+            m_changed.wait(lock);
+        }
+    }
+
+    // true when k was not finished by another worker already
+    bool complete(const int k)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_done[k])
+            return false;
+        m_done[k] = 1;
+        --m_remaining;
+        m_changed.notify_all();
+        return true;
+    }
+
+    // tiles of a worker that went away are handed out again
+    void abandon(const std::vector<int> &tiles)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int k : tiles)
+        {
+            if (!m_done[k])
+            {
+                --m_issued[k];
+                m_pending.push_back(k);
+            }
+        }
+        m_changed.notify_all();
+    }
+
+    bool finished()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_remaining == 0;
+    }
+
+    int reissued() const { return m_reissued; }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<int> m_pending;
+    std::vector<int> m_issued;
+    std::vector<char> m_done;
+    int m_remaining;
+    int m_reissued{0};
+};
+
+struct WorkerStats
+{
+    int fd{-1};
+    std::string name;
+    int tiles{0}, duplicates{0};
+    long pixels{0};
+    double seconds{0};
+};
+
+// Serves one worker connection: sends the scene options and the scene,
+// then batches of tiles until the frame is done, copying the returned
+// pixels into img. The coordinator owns and closes the socket.
+void serve_worker(const std::string &args, const std::string &xml,
+                  const TileGrid &grid, TileScheduler &sched, Image &img,
+                  WorkerStats &stats)
+{
+    const int fd = stats.fd;
+    auto start = std::chrono::high_resolution_clock::now();
+    bool ok = send_message(fd, MSG_OPTIONS, args.data(), args.size()) &&
+              send_message(fd, MSG_SCENE, xml.data(), xml.size());
+
+    uint32_t type;
+    std::vector<char> payload;
+    while (ok)
+    {
+        std::vector<int> batch = sched.next();
+        if (batch.empty())
+            break;
+
+        std::vector<int32_t> ids(batch.begin(), batch.end());
+        ok = send_message(fd, MSG_TILES, ids.data(),
+                          ids.size() * sizeof(int32_t));
+
+        std::vector<int> outstanding = batch;
+        while (ok && !outstanding.empty())
+        {
+            ok = recv_message(fd, type, payload) && type == MSG_TILE &&
+                 payload.size() >= sizeof(int32_t);
+            if (!ok)
+                break;
+
+            int32_t k;
+            memcpy(&k, payload.data(), sizeof(k));
+            auto it = std::find(outstanding.begin(), outstanding.end(), k);
+            int x0, y0, x1, y1;
+            grid.bounds(k, x0, y0, x1, y1);
+            size_t n = (x1 - x0) * (y1 - y0);
+            ok = it != outstanding.end() &&
+                 payload.size() == sizeof(int32_t) + n * sizeof(color);
+            if (!ok)
+                break;
+            outstanding.erase(it);
+
+            if (!sched.complete(k))
+            {
+                ++stats.duplicates;
+                continue;
+            }
+            const color *pixels =
+                reinterpret_cast<const color *>(payload.data() + sizeof(k));
+            for (int j = y0; j < y1; ++j)
+                for (int i = x0; i < x1; ++i)
+                    img.set_pixel(i, j, *pixels++);
+            ++stats.tiles;
+            stats.pixels += n;
+        }
+        if (!ok)
+            sched.abandon(outstanding);
+    }
+
+    if (ok)
+        send_message(fd, MSG_BYE, nullptr, 0);
+    else if (!sched.finished())
+        std::cerr << "Worker " << stats.name << " disconnected." << std::endl;
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::high_resolution_clock::now() - start)
+                        .count();
+}
+
+static std::vector<pid_t> spawn_workers(const int n, const Endpoint &ep)
+{
+    std::vector<pid_t> pids;
+    for (int i = 0; i < n; ++i)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            std::string arg = "--worker=" + ep.str();
+            execl("/proc/self/exe", "rtrace", arg.c_str(), (char *)nullptr);
+            _exit(127);
+        }
+        if (pid > 0)
+            pids.push_back(pid);
+    }
+    return pids;
+}
+
+// Coordinator: listens on opt.coordinator, sends the scene to every worker
+// that connects and assembles the tiles they return into img.
+bool raytracing_distributed(const Scene &scene, Image &img,
+                            const Options &opt)
+{
+    std::ifstream in{opt.scene_path, std::ios::in | std::ios::binary};
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string xml = ss.str();
+    std::string args;
+    for (auto &arg : scene_args(opt))
+        args += arg + "\n";
+
+    Endpoint ep;
+    ep.parse(opt.coordinator);
+    int listener = listen_on(ep);
+    if (listener < 0)
+    {
+        std::cerr << "Error: cannot listen on " << opt.coordinator << ": "
+                  << strerror(errno) << std::endl;
+        return false;
+    }
+    ep = bound_endpoint(ep, listener);
+    std::cout << "Coordinator listening on " << ep.str() << "\n";
+    std::vector<pid_t> children = spawn_workers(opt.spawn_workers, ep);
+
+    TileGrid grid(scene.camera);
+    TileScheduler sched(grid.count());
+    std::deque<WorkerStats> stats;
+    std::vector<std::thread> connections;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    while (!sched.finished())
+    {
+        pollfd pfd{listener, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        sockaddr_storage addr{};
+        socklen_t size = sizeof(addr);
+        int fd = accept(listener, reinterpret_cast<sockaddr *>(&addr), &size);
+        if (fd < 0)
+            continue;
+
+        char host[NI_MAXHOST] = "local";
+        if (!ep.unix_socket)
+            getnameinfo(reinterpret_cast<sockaddr *>(&addr), size, host,
+                        sizeof(host), nullptr, 0, NI_NUMERICHOST);
+        stats.emplace_back();
+        stats.back().fd = fd;
+        stats.back().name = std::string(host) + "#" +
+                            std::to_string(stats.size());
+        connections.emplace_back(serve_worker, std::cref(args), std::cref(xml),
+                                 std::cref(grid), std::ref(sched),
+                                 std::ref(img), std::ref(stats.back()));
+    }
+    // the frame is complete, cut off stragglers still rendering duplicates
+    for (auto &w : stats)
+        shutdown(w.fd, SHUT_RDWR);
+    for (auto &t : connections)
+        t.join();
+    for (auto &w : stats)
+        close(w.fd);
+    close(listener);
+    if (ep.unix_socket)
+        unlink(ep.path.c_str());
+    for (pid_t pid : children)
+        waitpid(pid, nullptr, 0);
+
+    auto duration = std::chrono::duration<double>(
+                        std::chrono::high_resolution_clock::now() - start)
+                        .count();
+    std::cout << "Rendering is completed in " << duration << " seconds on "
+              << stats.size() << " workers, " << sched.reissued()
+              << " tiles re-issued.\n";
+    for (auto &w : stats)
+    {
+        std::cout << "  worker " << w.name << ": " << w.tiles << " tiles, "
+                  << w.duplicates << " duplicates, "
+                  << (w.seconds > 0 ? w.pixels / w.seconds : 0)
+                  << " pixels/s\n";
+    }
+    return true;
+}
+
+// Worker: connects to a coordinator and renders the tiles it asks for until
+// it says bye.
+int run_worker(const Options &opt)
+{
+    Endpoint ep;
+    ep.parse(opt.worker);
+    int fd = connect_to(ep);
+    if (fd < 0)
+    {
+        std::cerr << "Error: cannot connect to " << opt.worker << ": "
+                  << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    uint32_t type;
+    std::vector<char> payload;
+    // the coordinator's scene options, parsed as if given to this worker
+    Options scene_opt;
+    bool configured = recv_message(fd, type, payload) && type == MSG_OPTIONS;
+    if (configured)
+    {
+        std::vector<std::string> args{"rtrace", "--worker=" + opt.worker};
+        std::istringstream in{std::string(payload.begin(), payload.end())};
+        for (std::string arg; std::getline(in, arg);)
+            args.push_back(arg);
+        std::vector<const char *> argv;
+        for (auto &arg : args)
+            argv.push_back(arg.c_str());
+        configured = parse_options(int(argv.size()), argv.data(), scene_opt);
+    }
+    Scene scene;
+    if (configured)
+        configure_scene(scene, scene_opt);
+    if (!configured || !recv_message(fd, type, payload) ||
+        type != MSG_SCENE ||
+        !scene_from_xml_buffer(scene, std::string(payload.begin(),
+                                                  payload.end())))
+    {
+        std::cerr << "Error: no valid scene from coordinator." << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    TileGrid grid(scene.camera);
+    Image img(scene.camera.nx, scene.camera.ny);
+    std::vector<char> out;
+    bool ok = true;
+    while (ok && recv_message(fd, type, payload) && type == MSG_TILES)
+    {
+        std::vector<int32_t> tiles(payload.size() / sizeof(int32_t));
+        memcpy(tiles.data(), payload.data(), tiles.size() * sizeof(int32_t));
+        parallel_for(tiles.size(), [&](const int t) {
+            render_tile(scene, img, grid, tiles[t]);
+        });
+
+        for (int32_t k : tiles)
+        {
+            int x0, y0, x1, y1;
+            grid.bounds(k, x0, y0, x1, y1);
+            out.resize(sizeof(k));
+            memcpy(out.data(), &k, sizeof(k));
+            for (int j = y0; j < y1; ++j)
+            {
+                for (int i = x0; i < x1; ++i)
+                {
+                    color c = img.get_pixel(i, j);
+                    const char *p = reinterpret_cast<const char *>(&c);
+                    out.insert(out.end(), p, p + sizeof(c));
+                }
+            }
+            ok = ok && send_message(fd, MSG_TILE, out.data(), out.size());
+        }
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+#endif // DISTRIBUTED_H
@@ -0,0 +1,305 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "render.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct GBufferHit
+{
+    point3 x;
+    vec3 n;
+    int material;
+};
+
+// Primary hits of every pixel followed by its mirror bounces. Shading and
+// shadow rays only depend on these, the lights and the material values, so
+// a cached G-buffer can relight a frame without tracing camera rays again.
+class GBuffer
+{
+public:
+    void capture(const Scene &scene)
+    {
+        m_nx = scene.camera.nx;
+        m_ny = scene.camera.ny;
+        m_geometry_hash = scene.geometry_hash;
+        m_camera_hash = camera_hash(scene.camera);
+        m_material_ids.clear();
+        m_material_mirror.clear();
+        for (auto &mat : scene.materials)
+        {
+            m_material_ids.push_back(mat.id);
+            m_material_mirror.push_back(len(mat.mirror_refl) > 0);
+        }
+
+        std::vector<std::vector<GBufferHit>> rows(m_ny);
+        std::vector<uint32_t> count(m_nx * m_ny);
+        m_escaped.assign(m_nx * m_ny, 0);
+        parallel_for(m_ny, [&](const int j) {
+            for (int i = 0; i < m_nx; ++i)
+            {
+                size_t before = rows[j].size();
+                m_escaped[j * m_nx + i] =
+                    trace_chain(scene, scene.camera.ray_to_pixel(i, j),
+                                rows[j]);
+                count[j * m_nx + i] = rows[j].size() - before;
+            }
+        });
+
+        m_first.assign(m_nx * m_ny + 1, 0);
+        for (size_t p = 0; p < count.size(); ++p)
+            m_first[p + 1] = m_first[p] + count[p];
+        m_hits.clear();
+        m_hits.reserve(m_first.back());
+        for (auto &row : rows)
+            m_hits.insert(m_hits.end(), row.begin(), row.end());
+    }
+
+    // true when the cached hits are still valid for scene, i.e. geometry,
+    // camera and the set of mirror materials did not change
+    bool matches(const Scene &scene) const
+    {
+        if (m_nx != scene.camera.nx || m_ny != scene.camera.ny ||
+            m_geometry_hash != scene.geometry_hash ||
+            m_camera_hash != camera_hash(scene.camera))
+            return false;
+
+        for (size_t i = 0; i < m_material_ids.size(); ++i)
+        {
+            int idx = scene.material_index(m_material_ids[i]);
+            bool mirror =
+                idx >= 0 && len(scene.materials[idx].mirror_refl) > 0;
+            if (idx < 0 || mirror != bool(m_material_mirror[i]))
+                return false;
+        }
+        return true;
+    }
+
+    void relight(const Scene &scene, Image &img) const
+    {
+        std::vector<int> remap;
+        for (auto &id : m_material_ids)
+            remap.push_back(scene.material_index(id));
+
+        parallel_for(m_ny, [&](const int j) {
+            for (int i = 0; i < m_nx; ++i)
+            {
+                int p = j * m_nx + i;
+                img.set_pixel(i, j, shade_chain(scene, remap, p));
+            }
+        });
+    }
+
+    bool save(const std::string &path) const
+    {
+        std::ofstream out{path, std::ios::out | std::ios::binary};
+        if (!out.is_open())
+            return false;
+
+        uint32_t n_materials = m_material_ids.size();
+        uint32_t n_hits = m_hits.size();
+        out.write(MAGIC, sizeof(MAGIC));
+        write(out, m_nx);
+        write(out, m_ny);
+        write(out, m_geometry_hash);
+        write(out, m_camera_hash);
+        write(out, n_materials);
+        for (uint32_t i = 0; i < n_materials; ++i)
+        {
+            uint32_t size = m_material_ids[i].size();
+            write(out, size);
+            out.write(m_material_ids[i].data(), size);
+            write(out, m_material_mirror[i]);
+        }
+        write(out, n_hits);
+        out.write(reinterpret_cast<const char *>(m_first.data()),
+                  m_first.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(m_escaped.data()),
+                  m_escaped.size());
+        out.write(reinterpret_cast<const char *>(m_hits.data()),
+                  m_hits.size() * sizeof(GBufferHit));
+        return out.good();
+    }
+
+    bool load(const std::string &path)
+    {
+        std::ifstream in{path, std::ios::in | std::ios::binary};
+        if (!in.is_open())
+            return false;
+
+        char magic[sizeof(MAGIC)];
+        in.read(magic, sizeof(magic));
+        if (!in || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+            return false;
+
+        uint32_t n_materials = 0, n_hits = 0;
+        read(in, m_nx);
+        read(in, m_ny);
+        read(in, m_geometry_hash);
+        read(in, m_camera_hash);
+        read(in, n_materials);
+        if (!in || m_nx <= 0 || m_ny <= 0 ||
+            int64_t(m_nx) * m_ny > MAX_PIXELS || n_materials > MAX_MATERIALS)
+            return false;
+
+        m_material_ids.resize(n_materials);
+        m_material_mirror.resize(n_materials);
+        for (uint32_t i = 0; i < n_materials && in; ++i)
+        {
+            uint32_t size = 0;
+            read(in, size);
+            if (!in || size > MAX_ID_SIZE)
+                return false;
+            m_material_ids[i].resize(size);
+            in.read(&m_material_ids[i][0], size);
+            read(in, m_material_mirror[i]);
+        }
+
+        read(in, n_hits);
+        if (!in || n_hits > uint64_t(m_nx) * m_ny * (MAX_DEPTH + 1))
+            return false;
+        m_first.resize(m_nx * m_ny + 1);
+        m_escaped.resize(m_nx * m_ny);
+        m_hits.resize(n_hits);
+        in.read(reinterpret_cast<char *>(m_first.data()),
+                m_first.size() * sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(m_escaped.data()), m_escaped.size());
+        in.read(reinterpret_cast<char *>(m_hits.data()),
+                m_hits.size() * sizeof(GBufferHit));
+        return in.good() && valid();
+    }
+
+    size_t hit_count() const { return m_hits.size(); }
+
+private:
+    static constexpr char MAGIC[8] = {'R', 'T', 'G', 'B', 'U', 'F', '1', 0};
+    // limits on what load accepts, well above any real render
+    static const int64_t MAX_PIXELS = int64_t(1) << 28;
+    static const uint32_t MAX_MATERIALS = 1 << 20;
+    static const uint32_t MAX_ID_SIZE = 1 << 16;
+
+    // whether loaded data can be relit without reading out of bounds:
+    // every pixel owns a chain of at most MAX_DEPTH + 1 hits, the chains
+    // cover m_hits in order and every hit refers to a cached material
+    bool valid() const
+    {
+        if (m_first.front() != 0 || m_first.back() != m_hits.size())
+            return false;
+        for (size_t p = 0; p + 1 < m_first.size(); ++p)
+            if (m_first[p + 1] < m_first[p] ||
+                m_first[p + 1] - m_first[p] > uint32_t(MAX_DEPTH + 1))
+                return false;
+        for (auto &h : m_hits)
+            if (h.material < -1 || h.material >= int(m_material_ids.size()))
+                return false;
+        return true;
+    }
+
+    template <typename T>
+    static void write(std::ostream &out, const T &v)
+    {
+        out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+
+    template <typename T>
+    static void read(std::istream &in, T &v)
+    {
+        in.read(reinterpret_cast<char *>(&v), sizeof(T));
+    }
+
+    static uint64_t camera_hash(const Camera &cam)
+    {
+        const int depth = MAX_DEPTH;
+        return hash_bytes(&depth, sizeof(depth), cam.hash());
+    }
+
+    // follows r and its mirror reflections exactly like ray_color does,
+    // returns true when the last ray escaped to the background
+    static bool trace_chain(const Scene &scene, ray r,
+                            std::vector<GBufferHit> &out)
+    {
+        for (int depth = MAX_DEPTH;; --depth)
+        {
+            ++(depth == MAX_DEPTH ? ray_stats.primary : ray_stats.reflection);
+            HitRecord rec;
+            if (!scene.hit(r, 0, INF, rec))
+                return true;
+
+            GBufferHit h{r.at(rec.t), unit_vec(rec.normal), rec.material};
+            out.push_back(h);
+
+            Material mat = h.material >= 0 ? scene.materials[h.material]
+                                           : Material();
+            if (!(len(mat.mirror_refl) > 0 && depth > 0))
+                return false;
+
+            vec3 w_o = unit_vec(scene.camera.position - h.x);
+            vec3 w_r = -w_o + 2 * h.n * dot(h.n, w_o);
+            r = ray(h.x + w_r * EPS, w_r);
+        }
+    }
+
+    color shade_chain(const Scene &scene, const std::vector<int> &remap,
+                      const int p) const
+    {
+        if (m_first[p] == m_first[p + 1])
+            return scene.background;
+
+        color c;
+        for (int k = m_first[p + 1] - 1; k >= int(m_first[p]); --k)
+        {
+            const GBufferHit &h = m_hits[k];
+            int idx = h.material >= 0 ? remap[h.material] : -1;
+            Material mat = idx >= 0 ? scene.materials[idx] : Material();
+
+            color next = c;
+            c = shade_direct(scene, h.x, h.n,
+                             unit_vec(scene.camera.position - h.x), mat);
+            if (k + 1 < int(m_first[p + 1]))
+                c += mat.mirror_refl * next;
+            else if (m_escaped[p])
+                c += mat.mirror_refl * scene.background;
+        }
+        return c;
+    }
+
+    int m_nx{0}, m_ny{0};
+    uint64_t m_geometry_hash{0}, m_camera_hash{0};
+    std::vector<std::string> m_material_ids;
+    std::vector<char> m_material_mirror;
+    std::vector<uint32_t> m_first;
+    std::vector<char> m_escaped;
+    std::vector<GBufferHit> m_hits;
+};
+
+void raytracing_gbuffer(const Scene &scene, Image &img,
+                        const std::string &path)
+{
+    GBuffer gbuf;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (gbuf.load(path) && gbuf.matches(scene))
+    {
+        std::cout << "Relighting from G-buffer " << path << " ("
+                  << gbuf.hit_count() << " cached hits).\n";
+    }
+    else
+    {
+        std::cout << "G-buffer " << path
+                  << " is missing or stale, tracing camera rays.\n";
+        gbuf.capture(scene);
+        if (!gbuf.save(path))
+            std::cerr << "Error: G-buffer " << path << " cannot be written."
+                      << std::endl;
+    }
+    gbuf.relight(scene, img);
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    std::cout << "Rendering is completed in " << duration.count() / 1000.0
+              << " seconds.\n";
+}
+
+#endif // GBUFFER_H
@@ -0,0 +1,124 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "render.h"
+#include "options.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+// maps v in [0,1] to black - blue - red - yellow - white
+static color false_colour(double v)
+{
+    static const color ramp[] = {color(0, 0, 0), color(0, 0, 255),
+                                 color(255, 0, 0), color(255, 255, 0),
+                                 color(255, 255, 255)};
+    v = std::min(1.0, std::max(0.0, v)) * 4;
+    int k = std::min(3, int(v));
+    double f = v - k;
+    return (1 - f) * ramp[k] + f * ramp[k + 1];
+}
+
+// Renders img while measuring the cost of every pixel, either the box and
+// triangle tests of all its rays or its wall time in nanoseconds, and
+// writes the costs as a false-colour image to <output>.heat.ppm. The tests
+// are also charged to the objects and summarised per object.
+void raytracing_heatmap(const Scene &scene, Image &img, const Options &opt)
+{
+    const bool timed = opt.heatmap == "time";
+    TileGrid grid(scene.camera);
+    std::vector<double> cost(grid.nx * grid.ny);
+    std::vector<ObjectCost> totals(scene.objects.size());
+    std::mutex totals_mutex;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    parallel_for(grid.count(), [&](const int k) {
+        std::vector<ObjectCost> local(scene.objects.size());
+        object_costs = &local;
+
+        int x0, y0, x1, y1;
+        grid.bounds(k, x0, y0, x1, y1);
+        for (int j = y0; j < y1; ++j)
+        {
+            for (int i = x0; i < x1; ++i)
+            {
+                RayStats before = ray_stats;
+                auto t0 = std::chrono::steady_clock::now();
+                img.set_pixel(i, j,
+                              ray_color(scene,
+                                        scene.camera.ray_to_pixel(i, j),
+                                        MAX_DEPTH));
+                cost[j * grid.nx + i] =
+                    timed ? std::chrono::duration<double, std::nano>(
+                                std::chrono::steady_clock::now() - t0)
+                                .count()
+                          : double(ray_stats.tests() - before.tests());
+            }
+        }
+
+        object_costs = nullptr;
+        std::lock_guard<std::mutex> lock(totals_mutex);
+        for (size_t o = 0; o < local.size(); ++o)
+            totals[o].add(local[o]);
+    });
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    std::cout << "Rendering is completed in " << duration.count() / 1000.0
+              << " seconds.\n";
+
+    // scale to the 99th percentile so a few outliers do not wash it out
+    std::vector<double> sorted = cost;
+    std::sort(sorted.begin(), sorted.end());
+    double scale = sorted[sorted.size() * 99 / 100];
+    scale = scale > 0 ? scale : 1;
+
+    Image heat(grid.nx, grid.ny);
+    for (int j = 0; j < grid.ny; ++j)
+        for (int i = 0; i < grid.nx; ++i)
+            heat.set_pixel(i, j, false_colour(cost[j * grid.nx + i] / scale));
+    std::string heat_path = opt.output_path + ".heat.ppm";
+    std::ofstream out{heat_path, std::ios::out};
+    heat.export_ppm(out);
+
+    const char *unit = timed ? "ns" : "tests";
+    std::cout << "Per-pixel cost (" << unit << "): min " << sorted.front()
+              << ", mean "
+              << std::accumulate(sorted.begin(), sorted.end(), 0.0) /
+                     sorted.size()
+              << ", p99 " << scale << ", max " << sorted.back()
+              << ", written to " << heat_path << "\n";
+
+    std::vector<size_t> order(totals.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return totals[a].tests() > totals[b].tests();
+    });
+    uint64_t all = 0;
+    for (auto &t : totals)
+        all += t.tests();
+    all = all ? all : 1;
+
+    std::cout << std::left << std::setw(20) << "object" << std::right
+              << std::setw(12) << "primitives" << std::setw(14) << "box tests"
+              << std::setw(16) << "triangle tests" << std::setw(13)
+              << "shape tests" << std::setw(12) << "hits" << std::setw(9)
+              << "share\n";
+    for (size_t o : order)
+    {
+        const ObjectCost &t = totals[o];
+        std::cout << std::left << std::setw(20) << scene.object_ids[o]
+                  << std::right << std::setw(12)
+                  << scene.object_primitives(o) << std::setw(14)
+                  << t.box_tests << std::setw(16) << t.triangle_tests
+                  << std::setw(13) << t.shape_tests << std::setw(12) << t.hits
+                  << std::setw(7) << std::fixed << std::setprecision(1)
+                  << 100.0 * t.tests() / all << "%\n"
+                  << std::defaultfloat;
+    }
+}
+
+#endif // HEATMAP_H
@@ -3,6 +3,11 @@
 
 #include "vec3.h"
 #include "ray.h"
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
 
 static const double EPSILON = 0.000001;
 static const double INF = std::numeric_limits<double>::infinity();
@@ -47,10 +52,61 @@ static double max(const double a, const double b)
     return a > b ? a : b;
 }
 
+// cos_a^e for a Phong exponent: by squaring for the integer exponents of
+// the scene format (phong_bits(e) squarings), std::pow otherwise
+static inline int phong_bits(const double e)
+{
+    if (!(e >= 0 && e < 65536) || e != std::floor(e))
+        return -1;
+    int bits = 0;
+    for (int i = int(e); i; i >>= 1)
+        ++bits;
+    return bits;
+}
+
+static inline double phong_pow(const double cos_a, const double e)
+{
+    int bits = phong_bits(e);
+    if (bits < 0)
+        return std::pow(cos_a, e);
+    double p = 1, b = cos_a;
+    for (int bit = 0, i = int(e); bit < bits; ++bit, b *= b)
+        p = (i >> bit) & 1 ? p * b : p;
+    return p;
+}
+
 static int clamp(const double a)
 {
     int x = static_cast<int>(a);
     return max(0, x > 255 ? 255 : x);
 }
 
+// FNV-1a, used to fingerprint scene data
+static inline uint64_t hash_bytes(const void *data, const size_t size,
+                                  uint64_t h = 14695981039346656037ull)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+    {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static inline uint64_t hash_string(const std::string &s, const uint64_t h)
+{
+    return hash_bytes(s.data(), s.size(), h);
+}
+
+static inline uint64_t hash_file(const char *path)
+{
+    std::ifstream in{path, std::ios::in | std::ios::binary};
+    char buf[1 << 16];
+    uint64_t h = hash_bytes(nullptr, 0);
+    while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+        h = hash_bytes(buf, in.gcount(), h);
+    return h;
+}
+
 #endif // HELPERS_H
\ No newline at end of file
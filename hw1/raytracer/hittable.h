@@ -1,24 +1,40 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "axisaligbounbox.h"
 #include "ray.h"
 #include "vec3.h"
 #include <string>
 
+// object is the index of the hit object in Scene::objects and material
+// the index of its material in Scene::materials, -1 when unknown.
+// primitive is the hit triangle in Scene::triangles for a mesh, -1 for the
+// other kinds (their object is a single primitive or a custom one).
 struct HitRecord
 {
   double t;
   vec3 normal;
-  std::string mat_id;
+  int object{-1};
+  int material{-1};
+  int primitive{-1};
 };
 
+// Extension point for primitive kinds without an array of their own in
+// Scene. They are reached through a virtual call per object and only have
+// to fill in t and normal of the record.
 class Hittable
 {
 public:
+  virtual ~Hittable() = default;
+
   virtual bool hit(const ray &r, const double &t_min, const double &t_max,
                    HitRecord &rec) const = 0;
 
   virtual bool boundingBoxInit() = 0;
+
+  virtual AxisAlignedBoundingBox boundingBox() const = 0;
+
+  virtual size_t primitiveCount() const = 0;
 };
 
 #endif
\ No newline at end of file
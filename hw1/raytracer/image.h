@@ -2,10 +2,27 @@
 #define IMAGE_H
 
 #include "vec3.h"
+#include "helpers.h"
+#include "trace.h"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
 
+// Colour framebuffer, with optional named layers of 1 or 3 float channels
+// per pixel (AOVs such as depth or normals) filled in the same pass and
+// written as PFM files next to the colour.
 class Image
 {
 public:
+  struct Layer
+  {
+    std::string name;
+    int channels;
+    std::vector<float> data;
+  };
+
   Image(const int width, const int height) : m_width{width}, m_height{height}
   {
     data = new color[width * height];
@@ -24,6 +41,30 @@ public:
     data[j * m_width + i] = c;
   }
 
+  // adds an empty layer and returns its index
+  int add_layer(const std::string &name, const int channels)
+  {
+    m_layers.push_back(
+        {name, channels,
+         std::vector<float>(size_t(m_width) * m_height * channels, 0.f)});
+    return int(m_layers.size()) - 1;
+  }
+
+  bool has_layers() const { return !m_layers.empty(); }
+  const std::vector<Layer> &layers() const { return m_layers; }
+
+  // sets the channels of layer l at (i, j) from v
+  void set_layer(const int l, const int i, const int j, const float *v)
+  {
+    Layer &layer = m_layers[l];
+    float *p = &layer.data[(size_t(j) * m_width + i) * layer.channels];
+    for (int c = 0; c < layer.channels; ++c)
+      p[c] = v[c];
+  }
+
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+
   color get_pixel(const int i, const int j) const
   {
     if (i < 0 || i > m_width || j < 0 || j > m_height)
@@ -33,6 +74,7 @@ public:
   }
   void export_ppm(std::ostream &out) const
   {
+    TRACE_SCOPE("export_ppm");
     out << "P3\n"
         << m_width << " " << m_height << "\n255\n";
     for (int j = 0; j < m_height; ++j)
@@ -46,9 +88,47 @@ public:
     }
   }
 
+  // binary PFM of layer l, "Pf" for one channel and "PF" for three, rows
+  // from the bottom up as the format wants
+  void export_pfm(const int l, std::ostream &out) const
+  {
+    TRACE_SCOPE("export_pfm");
+    const Layer &layer = m_layers[l];
+    const uint16_t one = 1;
+    char little;
+    std::memcpy(&little, &one, 1);
+    out << (layer.channels == 1 ? "Pf\n" : "PF\n") << m_width << " "
+        << m_height << "\n"
+        << (little ? "-1.0\n" : "1.0\n");
+    size_t row = size_t(m_width) * layer.channels;
+    for (int j = m_height - 1; j >= 0; --j)
+      out.write(reinterpret_cast<const char *>(&layer.data[j * row]),
+                row * sizeof(float));
+  }
+
+  // reads a P3 file written by export_ppm, fails on a size mismatch
+  bool import_ppm(std::istream &in)
+  {
+    std::string magic;
+    int width = 0, height = 0, max_value = 0;
+    if (!(in >> magic >> width >> height >> max_value) || magic != "P3" ||
+        width != m_width || height != m_height)
+      return false;
+
+    for (int p = 0; p < m_width * m_height; ++p)
+    {
+      int r, g, b;
+      if (!(in >> r >> g >> b))
+        return false;
+      data[p] = color(r, g, b);
+    }
+    return true;
+  }
+
 private:
   int m_width, m_height;
   color *data;
+  std::vector<Layer> m_layers;
 };
 
 #endif // IMAGE_H
\ No newline at end of file
@@ -0,0 +1,182 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "render.h"
+#include "deps.h"
+#include "options.h"
+#include "xml.h"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Differences between the scene of a previous render and the current one
+struct SceneDiff
+{
+    bool global{false};
+    bool light_added{false};
+    std::vector<std::string> lights, materials, objects;
+    // bounds of changed and added objects in the current scene
+    std::vector<AxisAlignedBoundingBox> new_boxes;
+};
+
+static bool same_material(const Material &a, const Material &b)
+{
+    return a.ambient == b.ambient && a.diffuse == b.diffuse &&
+           a.specular == b.specular && a.mirror_refl == b.mirror_refl &&
+           a.phong_exp == b.phong_exp;
+}
+
+SceneDiff diff_scenes(const Scene &prev, const Scene &scene)
+{
+    SceneDiff diff;
+    diff.global = prev.camera.hash() != scene.camera.hash() ||
+                  !(prev.background == scene.background) ||
+                  !(prev.ambient == scene.ambient);
+
+    std::map<std::string, const Pointlight *> lights;
+    for (size_t i = 0; i < prev.lights.size(); ++i)
+        lights[light_key(prev, i)] = &prev.lights[i];
+    for (size_t i = 0; i < scene.lights.size(); ++i)
+    {
+        std::string key = light_key(scene, i);
+        auto it = lights.find(key);
+        if (it == lights.end())
+        {
+            diff.light_added = true;
+            continue;
+        }
+        if (!(it->second->position == scene.lights[i].position) ||
+            !(it->second->intensity == scene.lights[i].intensity))
+            diff.lights.push_back(key);
+        lights.erase(it);
+    }
+    for (auto &l : lights)
+        diff.lights.push_back(l.first);
+
+    for (auto &m : prev.materials)
+    {
+        int idx = scene.material_index(m.id);
+        if (idx < 0 || !same_material(m, scene.materials[idx]))
+            diff.materials.push_back(m.id);
+    }
+    // a newly defined id changes the objects that referenced it while it
+    // was undefined (tiles record the id of the object, defined or not)
+    for (auto &m : scene.materials)
+        if (prev.material_index(m.id) < 0)
+            diff.materials.push_back(m.id);
+
+    std::map<std::string, uint64_t> objects;
+    for (size_t i = 0; i < prev.objects.size(); ++i)
+        objects[prev.object_ids[i]] = prev.object_hashes[i];
+    for (size_t i = 0; i < scene.objects.size(); ++i)
+    {
+        auto it = objects.find(scene.object_ids[i]);
+        if (it != objects.end() && it->second == scene.object_hashes[i])
+        {
+            objects.erase(it);
+            continue;
+        }
+        if (it != objects.end())
+        {
+            diff.objects.push_back(it->first);
+            objects.erase(it);
+        }
+        diff.new_boxes.push_back(scene.objects[i].box);
+    }
+    for (auto &o : objects)
+        diff.objects.push_back(o.first);
+
+    return diff;
+}
+
+static bool intersects(const std::vector<std::string> &ids,
+                       const std::vector<std::string> &changed)
+{
+    for (auto &id : changed)
+        if (std::binary_search(ids.begin(), ids.end(), id))
+            return true;
+    return false;
+}
+
+// A tile has to be rendered again when its rays used a changed light or
+// material, hit a changed or removed object, or could reach the new
+// position of a changed or added one.
+std::vector<char> affected_tiles(const SceneDiff &diff, const DepsFile &deps)
+{
+    std::vector<char> mask(deps.tiles.size(), diff.global);
+    for (size_t k = 0; k < deps.tiles.size() && !diff.global; ++k)
+    {
+        const TileRecord &t = deps.tiles[k];
+        bool affected = intersects(t.materials, diff.materials) ||
+                        intersects(t.lights, diff.lights) ||
+                        intersects(t.objects, diff.objects) ||
+                        (diff.light_added && !t.materials.empty());
+        for (auto &b : diff.new_boxes)
+        {
+            affected = affected || b.overlaps(t.footprint) ||
+                       (t.escaped && !deps.scene_bounds.contains(b));
+        }
+        mask[k] = affected;
+    }
+    return mask;
+}
+
+static std::string deps_path(const std::string &output_path)
+{
+    return output_path + ".deps";
+}
+
+void save_deps(const Scene &scene, const std::vector<TileRecord> &records,
+               const std::string &output_path)
+{
+    TileGrid grid(scene.camera);
+    DepsFile deps;
+    deps.tile_size = grid.size;
+    deps.nx = grid.nx;
+    deps.ny = grid.ny;
+    deps.scene_bounds = scene_bounds(scene);
+    deps.tiles = records;
+    if (!deps.save(deps_path(output_path)))
+        std::cerr << "Error: Dependency records "
+                  << deps_path(output_path) << " cannot be written."
+                  << std::endl;
+}
+
+// Renders scene into img, reusing the tiles of a previous output that the
+// scene changes cannot have affected. Falls back to a full render when the
+// previous run cannot be used. Without a previous scene this is a full
+// render that only records the dependencies for the next run.
+void raytracing_incremental(const Scene &scene, Image &img,
+                            const Options &opt)
+{
+    TileGrid grid(scene.camera);
+    Scene prev;
+    DepsFile deps;
+    std::ifstream prev_out{opt.prev_output, std::ios::in};
+    std::vector<char> mask;
+
+    if (opt.prev_scene.empty())
+        ;
+    else if (!scene_from_xml_file(prev, opt.prev_scene.c_str()))
+        std::cerr << "Previous scene " << opt.prev_scene
+                  << " cannot be parsed, rendering all tiles." << std::endl;
+    else if (!deps.load(deps_path(opt.prev_output)) ||
+             deps.tile_size != grid.size || deps.nx != grid.nx ||
+             deps.ny != grid.ny || int(deps.tiles.size()) != grid.count())
+        std::cerr << "No usable dependency records for " << opt.prev_output
+                  << ", rendering all tiles." << std::endl;
+    else if (!img.import_ppm(prev_out))
+        std::cerr << "Previous output " << opt.prev_output
+                  << " cannot be read, rendering all tiles." << std::endl;
+    else
+        mask = affected_tiles(diff_scenes(prev, scene), deps);
+
+    std::vector<TileRecord> records = deps.tiles;
+    raytracing_threaded(scene, img, mask.empty() ? nullptr : &mask,
+                        &records);
+    save_deps(scene, records, opt.output_path);
+}
+
+#endif // INCREMENTAL_H
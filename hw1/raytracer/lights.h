@@ -0,0 +1,139 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "arena.h"
+#include "axisaligbounbox.h"
+#include "helpers.h"
+#include "vec3.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Point lights that can reach a shaded point. With a cutoff every light
+// gets an influence radius, the distance beyond which its 1/d^2 falloff
+// leaves less than cutoff (in 0-255 colour levels) of direct light on the
+// most reflective material of the scene. A uniform grid over the spheres
+// of influence lists the lights overlapping each cell, so a point only
+// looks at the lights of its cell. Without a cutoff there is one cell with
+// every light and nothing is culled.
+class LightIndex
+{
+public:
+    explicit LightIndex(std::pmr::memory_resource *mr)
+        : m_radius2{mr}, m_start{mr}, m_lights{mr}
+    {
+    }
+
+    // positions and intensities of the lights, reflectance is the largest
+    // diffuse plus specular component of any material
+    template <typename Lights>
+    void build(const Lights &lights, const double reflectance,
+               const double cutoff)
+    {
+        size_t n = lights.size();
+        m_radius2.assign(n, INF);
+        m_bounds = AxisAlignedBoundingBox(point3(-INF, -INF, -INF),
+                                          point3(INF, INF, INF));
+        for (int a = 0; a < 3; ++a)
+        {
+            m_res[a] = 1;
+            m_inv_size[a] = 0;
+        }
+
+        double mean = 0;
+        if (cutoff > 0)
+        {
+            m_bounds = AxisAlignedBoundingBox();
+            for (size_t i = 0; i < n; ++i)
+            {
+                const color &I = lights[i].intensity;
+                double peak = std::max({I.x, I.y, I.z, 0.0}) * reflectance;
+                m_radius2[i] = peak / cutoff;
+                double r = std::sqrt(m_radius2[i]);
+                mean += r / n;
+                m_bounds.expand(lights[i].position - vec3(r, r, r));
+                m_bounds.expand(lights[i].position + vec3(r, r, r));
+            }
+        }
+        // cells about the size of an average sphere of influence
+        for (int a = 0; a < 3 && n && mean > 0; ++a)
+        {
+            double ext = m_bounds.max()[a] - m_bounds.min()[a];
+            m_res[a] =
+                std::max(1, std::min(MAX_RES, int(std::ceil(ext / mean))));
+            m_inv_size[a] = m_res[a] / ext;
+        }
+
+        // counting sort of the (cell, light) pairs, lights of a cell stay in
+        // scene order so the sums match the unculled loop
+        size_t cells = size_t(m_res[0]) * m_res[1] * m_res[2];
+        std::vector<uint32_t> count(cells + 1, 0);
+        auto each_cell = [&](const uint32_t i, auto f) {
+            double r = std::sqrt(m_radius2[i]);
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = cell(a, lights[i].position[a] - r);
+                hi[a] = cell(a, lights[i].position[a] + r);
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        f((size_t(z) * m_res[1] + y) * m_res[0] + x);
+        };
+        for (uint32_t i = 0; i < n; ++i)
+            each_cell(i, [&](size_t c) { ++count[c + 1]; });
+        for (size_t c = 0; c < cells; ++c)
+            count[c + 1] += count[c];
+        m_start.assign(count.begin(), count.end());
+        m_lights.assign(count[cells], 0);
+        for (uint32_t i = 0; i < n; ++i)
+            each_cell(i, [&](size_t c) { m_lights[count[c]++] = i; });
+    }
+
+    // candidate lights of x in [first, last), empty outside every sphere of
+    // influence
+    void query(const point3 &x, const uint32_t *&first,
+               const uint32_t *&last) const
+    {
+        first = last = m_lights.data();
+        const point3 &lo = m_bounds.min(), &hi = m_bounds.max();
+        for (int a = 0; a < 3; ++a)
+            if (!(x[a] >= lo[a] && x[a] <= hi[a]))
+                return;
+        size_t c = (size_t(cell(2, x.z)) * m_res[1] + cell(1, x.y)) *
+                       m_res[0] +
+                   cell(0, x.x);
+        first = m_lights.data() + m_start[c];
+        last = m_lights.data() + m_start[c + 1];
+    }
+
+    // whether light i reaches a point at l_to_x from it
+    bool reaches(const uint32_t i, const vec3 &l_to_x) const
+    {
+        return dot(l_to_x, l_to_x) <= m_radius2[i];
+    }
+
+private:
+    static const int MAX_RES = 32;
+
+    // union of the spheres of influence
+    AxisAlignedBoundingBox m_bounds;
+    int m_res[3];
+    double m_inv_size[3];
+    // squared influence radius of every light
+    ArenaVector<double> m_radius2;
+    // lights of cell c are m_lights[m_start[c] .. m_start[c + 1])
+    ArenaVector<uint32_t> m_start, m_lights;
+
+    int cell(const int a, const double x) const
+    {
+        if (m_res[a] == 1)
+            return 0;
+        int c = int((x - m_bounds.min()[a]) * m_inv_size[a]);
+        return std::max(0, std::min(m_res[a] - 1, c));
+    }
+};
+
+#endif // LIGHTS_H
@@ -3,71 +3,129 @@
 
 #include "vec3.h"
 #include "axisaligbounbox.h"
+#include "hittable.h"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <limits>
+#include <unordered_map>
+#include "arena.h"
 #include "helpers.h"
 
-class Mesh : public Hittable
+// Triangle meshes. All meshes share one pool of float positions and one
+// array of triangles holding 0-based indices into it; every mesh is a
+// contiguous range of that array. The loader rebases the 1-based ids of
+// the scene file and may weld duplicate vertices.
+
+struct Vertex
+{
+    float x, y, z;
+
+    Vertex() = default;
+    explicit Vertex(const point3 &p) : x(p.x), y(p.y), z(p.z) {}
+
+    point3 point() const { return point3(x, y, z); }
+};
+
+struct Triangle
+{
+    uint32_t v0, v1, v2;
+};
+
+// Adds positions to a pool. With weld >= 0 a position falling into the
+// same cell of a grid of size weld as an earlier one reuses it; weld 0
+// only merges identical float positions, so the geometry stays the same.
+class VertexWelder
 {
 public:
-    Mesh(const std::vector<point3> &vertices, const std::vector<int> &indices,
-         const std::string &material_id)
-        : m_vertices{vertices}, m_indices{indices}, mat_id{material_id}
+    VertexWelder(ArenaVector<Vertex> &pool, const double weld)
+        : m_pool{pool}, m_weld{weld}
     {
-        boundingBoxInit();
-    };
-    bool hit(const ray &r, const double &t_min, const double &t_max,
-             HitRecord &rec) const override
+    }
+
+    uint32_t add(const point3 &p)
     {
-        if (!m_boundingBox.hit(r, t_min, t_max))
-            return false;
+        Vertex v(p);
+        if (m_weld < 0)
+        {
+            m_pool.push_back(v);
+            return m_pool.size() - 1;
+        }
 
-        rec.t = INF;
-        double t = -1;
-        bool ret = false;
+        Key k;
+        if (m_weld > 0)
+            k = {std::llround(p.x / m_weld), std::llround(p.y / m_weld),
+                 std::llround(p.z / m_weld)};
+        else
+            k = {bits(v.x), bits(v.y), bits(v.z)};
+        auto it = m_index.emplace(k, uint32_t(m_pool.size()));
+        if (it.second)
+            m_pool.push_back(v);
+        return it.first->second;
+    }
 
-        for (size_t j = 0; j < m_indices.size() - 2; j += 3)
+private:
+    using Key = std::array<long long, 3>;
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const
         {
-            int i0 = m_indices[j] - 1;
-            int i1 = m_indices[j + 1] - 1;
-            int i2 = m_indices[j + 2] - 1;
-            if (intersect(m_vertices[i0], m_vertices[i1], m_vertices[i2], r, t_min,
-                          t_max, t) &&
-                rec.t > t)
-            {
-                rec.t = t;
-                rec.normal = cross(m_vertices[i1] - m_vertices[i0],
-                                   m_vertices[i2] - m_vertices[i0]);
-                rec.mat_id = mat_id;
-                ret = true;
-            }
+            return hash_bytes(k.data(), sizeof(Key));
         }
-        return ret;
-    }
+    };
 
-    bool boundingBoxInit() override
+    static long long bits(const float f)
     {
-        point3 min_point = point3(INF, INF, INF);
-        point3 max_point = point3(-INF, -INF, -INF);
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    ArenaVector<Vertex> &m_pool;
+    double m_weld;
+    std::unordered_map<Key, uint32_t, KeyHash> m_index;
+};
 
-        for (const auto &v : m_vertices)
+// closest hit of r with the n triangles at tris, rec.primitive is the
+// index of the hit one in tris
+static bool hit_triangles(const Vertex *pos, const Triangle *tris,
+                          const size_t n, const ray &r, const double &t_min,
+                          const double &t_max, HitRecord &rec)
+{
+    rec.t = INF;
+    double t = -1;
+    bool ret = false;
+
+    for (size_t j = 0; j < n; ++j)
+    {
+        point3 v0 = pos[tris[j].v0].point();
+        point3 v1 = pos[tris[j].v1].point();
+        point3 v2 = pos[tris[j].v2].point();
+        if (intersect(v0, v1, v2, r, t_min, t_max, t) && rec.t > t)
         {
-            min_point.x = fmin(min_point.x, v.x);
-            min_point.y = fmin(min_point.y, v.y);
-            min_point.z = fmin(min_point.z, v.z);
-            max_point.x = fmax(max_point.x, v.x);
-            max_point.y = fmax(max_point.y, v.y);
-            max_point.z = fmax(max_point.z, v.z);
+            rec.t = t;
+            rec.normal = cross(v1 - v0, v2 - v0);
+            rec.primitive = j;
+            ret = true;
         }
-        m_boundingBox = AxisAlignedBoundingBox(point3(min_point.x, min_point.y, min_point.z),
-                                               point3(max_point.x, max_point.y, max_point.z));
-        return true;
     }
+    return ret;
+}
 
-private:
-    const std::vector<point3> &m_vertices;
-    std::vector<int> m_indices;
-    std::string mat_id;
-    AxisAlignedBoundingBox m_boundingBox;
-};
+static AxisAlignedBoundingBox triangle_bounds(const Vertex *pos,
+                                              const Triangle *tris,
+                                              const size_t n)
+{
+    AxisAlignedBoundingBox box;
+    for (size_t j = 0; j < n; ++j)
+    {
+        box.expand(pos[tris[j].v0].point());
+        box.expand(pos[tris[j].v1].point());
+        box.expand(pos[tris[j].v2].point());
+    }
+    return box;
+}
 
-#endif // MESH_H
\ No newline at end of file
+#endif // MESH_H
@@ -0,0 +1,175 @@
+#ifndef NET_H
+#define NET_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// Endpoints are written "tcp:host:port" or "unix:path". A TCP listener on
+// port 0 gets an ephemeral port, see bound_endpoint.
+struct Endpoint
+{
+    bool unix_socket{false};
+    std::string host, port, path;
+
+    bool parse(const std::string &s)
+    {
+        if (s.compare(0, 5, "unix:") == 0)
+        {
+            unix_socket = true;
+            path = s.substr(5);
+            return !path.empty() && path.size() < sizeof(sockaddr_un::sun_path);
+        }
+        if (s.compare(0, 4, "tcp:") != 0)
+            return false;
+        size_t colon = s.rfind(':');
+        if (colon <= 3)
+            return false;
+        host = s.substr(4, colon - 4);
+        port = s.substr(colon + 1);
+        return !host.empty() && !port.empty();
+    }
+
+    std::string str() const
+    {
+        return unix_socket ? "unix:" + path : "tcp:" + host + ":" + port;
+    }
+};
+
+static int socket_for(const Endpoint &ep, const bool listening)
+{
+    if (ep.unix_socket)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, ep.path.c_str(), sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            unlink(ep.path.c_str());
+        int rc = listening
+                     ? bind(fd, reinterpret_cast<sockaddr *>(&addr),
+                            sizeof(addr))
+                     : connect(fd, reinterpret_cast<sockaddr *>(&addr),
+                               sizeof(addr));
+        if (rc != 0 || (listening && listen(fd, 64) != 0))
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(ep.host.c_str(), ep.port.c_str(), &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int rc = listening ? bind(fd, ai->ai_addr, ai->ai_addrlen)
+                           : connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (rc != 0 || (listening && listen(fd, 64) != 0))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+inline int listen_on(const Endpoint &ep) { return socket_for(ep, true); }
+
+inline int connect_to(const Endpoint &ep) { return socket_for(ep, false); }
+
+// ep with the port actually bound by listener fd
+static Endpoint bound_endpoint(const Endpoint &ep, const int fd)
+{
+    Endpoint bound = ep;
+    if (ep.unix_socket)
+        return bound;
+    sockaddr_storage addr{};
+    socklen_t size = sizeof(addr);
+    char port[NI_MAXSERV];
+    if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &size) == 0 &&
+        getnameinfo(reinterpret_cast<sockaddr *>(&addr), size, nullptr, 0,
+                    port, sizeof(port), NI_NUMERICSERV) == 0)
+        bound.port = port;
+    return bound;
+}
+
+static bool send_all(const int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(const int fd, void *data, size_t size)
+{
+    char *p = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Messages are a type, a payload size and the payload
+struct MessageHeader
+{
+    uint32_t type;
+    uint32_t size;
+};
+
+static bool send_message(const int fd, const uint32_t type, const void *data,
+                         const size_t size)
+{
+    MessageHeader h{type, uint32_t(size)};
+    return send_all(fd, &h, sizeof(h)) && send_all(fd, data, size);
+}
+
+static bool recv_message(const int fd, uint32_t &type,
+                         std::vector<char> &payload)
+{
+    MessageHeader h;
+    if (!recv_all(fd, &h, sizeof(h)))
+        return false;
+    type = h.type;
+    payload.resize(h.size);
+    return recv_all(fd, payload.data(), h.size);
+}
+
+#endif // NET_H
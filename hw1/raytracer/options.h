@@ -0,0 +1,512 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "net.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct Options
+{
+    std::string scene_path;
+    std::string output_path = "rtrace_out.ppm";
+
+    // draft mode: trace a sparse grid of draft_step pixels and refine only
+    // the blocks whose corners disagree
+    bool draft = false;
+    int draft_step = 8;
+    double draft_threshold = 8.0;
+    bool draft_error = false;
+
+    // relight from a cached G-buffer, or capture one when it is stale
+    std::string gbuffer_path;
+
+    // per-tile dependency records (<output>.deps) and incremental re-render
+    // against a previous scene and its output
+    bool record_deps = false;
+    std::string prev_scene, prev_output;
+
+    // flush finished tiles to <output>.ckpt every checkpoint_interval
+    // seconds, and continue from them with resume
+    bool checkpoint = false;
+    int checkpoint_interval = 30;
+    bool resume = false;
+
+    // coordinator/worker tile distribution, endpoints are tcp:host:port or
+    // unix:path
+    std::string coordinator, worker;
+    int spawn_workers = 0;
+
+    // render daemon keeping cache_size parsed scenes, and a client that
+    // submits this scene (or asks for stats) with camera overrides
+    std::string daemon, submit;
+    int cache_size = 4;
+    std::vector<std::string> camera_overrides;
+
+    // per-pixel cost image and per-object summary, "tests" or "time"
+    std::string heatmap;
+
+    // weld mesh vertices closer than weld (0: exact duplicates, negative:
+    // off) and print the geometry memory after loading
+    double weld = -1;
+    bool memory = false;
+
+    // spatial splits in the mesh BVHs, adding at most sbvh times the
+    // triangle count as duplicate references, negative is off
+    double sbvh = -1;
+
+    // search structure over the mesh triangles, "linear" (the mesh BVHs one
+    // by one), "grid" or "octree"
+    std::string accel = "linear";
+
+    // skip lights contributing less than light_cutoff colour levels,
+    // negative shades every light
+    double light_cutoff = -1;
+    // test the last blocker of each light before a full shadow query
+    bool shadow_cache = true;
+    // test the primitive hit by the previous pixel before a camera ray
+    bool primary_cache = true;
+    // shade the camera hits of a tile row together, see shade_batch
+    bool batch_shading = true;
+    // rasterize the camera rays instead of tracing them, see raster.h
+    bool raster = false;
+    // write depth, normal, albedo and id layers next to the output
+    bool aov = false;
+
+    // Chrome trace of the run, needs a build with -DRT_TRACE
+    std::string trace_path;
+
+    // worker threads, 0 is one per hardware thread
+    unsigned int threads = 0;
+
+    // benchmark: scenes, subdivision levels and thread counts to sweep
+    std::vector<std::string> bench_scenes;
+    std::vector<int> bench_subdivisions{0};
+    std::vector<unsigned int> bench_threads;
+    std::string bench_json;
+    int bench_nx = 0, bench_ny = 0;
+    bool bench_perf = false;
+    // box test microbenchmark with this many boxes, 0 is off
+    int bench_boxes = 0;
+    // accelerators to compare
+    std::vector<std::string> bench_accels{"linear"};
+};
+
+static bool valid_accel(const std::string &name)
+{
+    return name == "linear" || name == "grid" || name == "octree";
+}
+
+template <typename T>
+static std::vector<T> split_list(const std::string &value)
+{
+    std::vector<T> list;
+    std::stringstream ss{value};
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        std::stringstream is{item};
+        T v;
+        if (!(is >> v))
+            throw std::invalid_argument(item);
+        list.push_back(v);
+    }
+    return list;
+}
+
+static bool option_value(const std::string &arg, const std::string &name,
+                         std::string &value)
+{
+    if (arg.compare(0, name.length(), name) != 0)
+        return false;
+    if (arg.length() == name.length())
+    {
+        value.clear();
+        return true;
+    }
+    if (arg[name.length()] != '=')
+        return false;
+    value = arg.substr(name.length() + 1);
+    return true;
+}
+
+static void print_usage()
+{
+    std::cerr << "Usage: ./rtrace <path_to_scene> <output_path>(optional) "
+                 "[options]\n"
+              << "  --draft[=step]          trace a sparse grid and "
+                 "interpolate flat regions\n"
+              << "  --draft-threshold=val   max colour difference (0-255) "
+                 "between block corners\n"
+              << "  --draft-error           also render the full frame and "
+                 "report the draft error\n"
+              << "  --gbuffer=path          relight from a cached G-buffer, "
+                 "tracing and saving it when stale\n"
+              << "  --record-deps           write per-tile dependency "
+                 "records to <output_path>.deps\n"
+              << "  --prev-scene=path       scene of a previous render, only "
+                 "re-render tiles it changed\n"
+              << "  --prev-output=path      output of that render, with its "
+                 ".deps next to it\n"
+              << "  --checkpoint[=seconds]  periodically save finished tiles "
+                 "to <output_path>.ckpt\n"
+              << "  --resume                skip the tiles saved by an "
+                 "interrupted checkpointed render\n"
+              << "  --coordinator=endpoint  hand out tiles to workers "
+                 "connecting to tcp:host:port or unix:path\n"
+              << "  --spawn-workers=n       start n local workers for the "
+                 "coordinator\n"
+              << "  --worker=endpoint       render tiles for the coordinator "
+                 "at endpoint (no scene argument)\n"
+              << "  --daemon=endpoint       serve render jobs, keeping "
+                 "parsed scenes in memory\n"
+              << "  --cache-size=n          scenes kept by the daemon "
+                 "(default 4)\n"
+              << "  --submit=endpoint       send this scene as a job to a "
+                 "daemon, or ask for stats without a scene\n"
+              << "  --camera=key=value      camera override for --submit, "
+                 "e.g. position=0,0,1 or resolution=640x480\n"
+              << "  --heatmap[=tests|time]  write per-pixel cost to "
+                 "<output_path>.heat.ppm and a per-object summary\n"
+              << "  --trace=path            write a Chrome trace of parse, "
+                 "build, tiles and export (make TRACE=1)\n"
+              << "  --weld[=eps]            merge mesh vertices closer than "
+                 "eps (default: exact duplicates)\n"
+              << "  --memory                print the geometry memory before "
+                 "and after compaction\n"
+              << "  --sbvh[=budget]         build the mesh BVHs with spatial "
+                 "splits, at most budget x triangles\n"
+              << "                          extra references (default 0.3)\n"
+              << "  --accel=name            search the meshes with linear "
+                 "(BVH per mesh), grid or octree\n"
+              << "  --light-cutoff[=levels] skip lights adding less than "
+                 "levels (0-255, default 0.5)\n"
+              << "  --no-shadow-cache       always run full shadow queries, "
+                 "without the last blocker per light\n"
+              << "  --no-primary-cache      trace camera rays without first "
+                 "testing the previous pixel's hit\n"
+              << "  --no-batch-shading      shade every camera hit on its "
+                 "own\n"
+              << "  --raster                rasterize the primary "
+                 "visibility, trace only shading rays\n"
+              << "  --aov                   also write <output_path>.depth, "
+                 ".normal, .albedo and .id.pfm\n"
+              << "  --threads=n             worker threads (default: one "
+                 "per hardware thread)\n"
+              << "  --bench=a.xml,b.xml     benchmark the scenes and print "
+                 "JSON\n"
+              << "  --bench-subdiv=0,1,2    also split every triangle into "
+                 "4^level triangles\n"
+              << "  --bench-threads=1,2,4   thread counts (default: powers "
+                 "of two up to all threads)\n"
+              << "  --bench-resolution=WxH  override the scene resolution\n"
+              << "  --bench-accel=a,b       accelerators to compare "
+                 "(default linear)\n"
+              << "  --bench-json=path       write the results to path\n"
+              << "  --bench-perf            also read hardware counters "
+                 "(perf_event_open) per phase and thread\n"
+              << "  --bench-box[=n]         time the ray-box tests on n "
+                 "random boxes (default 1024)\n";
+}
+
+bool parse_options(int argc, const char *argv[], Options &opt)
+{
+    int positional = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        try
+        {
+            std::string arg = argv[i];
+            std::string value;
+
+            if (arg.compare(0, 2, "--") != 0)
+            {
+                if (positional == 0)
+                    opt.scene_path = arg;
+                else if (positional == 1)
+                    opt.output_path = arg;
+                else
+                {
+                    std::cerr << "Unexpected argument: " << arg << std::endl;
+                    return false;
+                }
+                ++positional;
+            }
+            else if (option_value(arg, "--draft-threshold", value))
+                opt.draft_threshold = std::stod(value);
+            else if (option_value(arg, "--draft-error", value))
+                opt.draft = opt.draft_error = true;
+            else if (option_value(arg, "--gbuffer", value))
+                opt.gbuffer_path = value;
+            else if (option_value(arg, "--record-deps", value))
+                opt.record_deps = true;
+            else if (option_value(arg, "--prev-scene", value))
+                opt.prev_scene = value;
+            else if (option_value(arg, "--prev-output", value))
+                opt.prev_output = value;
+            else if (option_value(arg, "--checkpoint", value))
+            {
+                opt.checkpoint = true;
+                if (!value.empty())
+                    opt.checkpoint_interval = std::stoi(value);
+            }
+            else if (option_value(arg, "--resume", value))
+                opt.checkpoint = opt.resume = true;
+            else if (option_value(arg, "--coordinator", value))
+                opt.coordinator = value;
+            else if (option_value(arg, "--spawn-workers", value))
+                opt.spawn_workers = std::stoi(value);
+            else if (option_value(arg, "--worker", value))
+                opt.worker = value;
+            else if (option_value(arg, "--daemon", value))
+                opt.daemon = value;
+            else if (option_value(arg, "--cache-size", value))
+                opt.cache_size = std::stoi(value);
+            else if (option_value(arg, "--submit", value))
+                opt.submit = value;
+            else if (option_value(arg, "--camera", value))
+                opt.camera_overrides.push_back(value);
+            else if (option_value(arg, "--heatmap", value))
+            {
+                opt.heatmap = value.empty() ? "tests" : value;
+                if (opt.heatmap != "tests" && opt.heatmap != "time")
+                    throw std::invalid_argument(value);
+            }
+            else if (option_value(arg, "--trace", value))
+                opt.trace_path = value;
+            else if (option_value(arg, "--weld", value))
+            {
+                opt.weld = value.empty() ? 0 : std::stod(value);
+                if (opt.weld < 0)
+                    throw std::invalid_argument(value);
+            }
+            else if (option_value(arg, "--sbvh", value))
+            {
+                opt.sbvh = value.empty() ? 0.3 : std::stod(value);
+                if (opt.sbvh < 0)
+                    throw std::invalid_argument(value);
+            }
+            else if (option_value(arg, "--accel", value))
+            {
+                opt.accel = value;
+                if (!valid_accel(value))
+                    throw std::invalid_argument(value);
+            }
+            else if (option_value(arg, "--light-cutoff", value))
+            {
+                opt.light_cutoff = value.empty() ? 0.5 : std::stod(value);
+                if (opt.light_cutoff <= 0)
+                    throw std::invalid_argument(value);
+            }
+            else if (arg == "--no-shadow-cache")
+                opt.shadow_cache = false;
+            else if (arg == "--no-primary-cache")
+                opt.primary_cache = false;
+            else if (arg == "--no-batch-shading")
+                opt.batch_shading = false;
+            else if (arg == "--raster")
+                opt.raster = true;
+            else if (arg == "--aov")
+                opt.aov = true;
+            else if (arg == "--memory")
+                opt.memory = true;
+            else if (option_value(arg, "--threads", value))
+                opt.threads = std::stoi(value);
+            else if (option_value(arg, "--bench-subdiv", value))
+                opt.bench_subdivisions = split_list<int>(value);
+            else if (option_value(arg, "--bench-threads", value))
+                opt.bench_threads = split_list<unsigned int>(value);
+            else if (option_value(arg, "--bench-box", value))
+            {
+                opt.bench_boxes = value.empty() ? 1024 : std::stoi(value);
+                if (opt.bench_boxes < 1)
+                    throw std::invalid_argument(value);
+            }
+            else if (option_value(arg, "--bench-accel", value))
+            {
+                opt.bench_accels = split_list<std::string>(value);
+                for (const std::string &name : opt.bench_accels)
+                    if (!valid_accel(name))
+                        throw std::invalid_argument(name);
+            }
+            else if (arg == "--bench-perf")
+                opt.bench_perf = true;
+            else if (option_value(arg, "--bench-json", value))
+                opt.bench_json = value;
+            else if (option_value(arg, "--bench-resolution", value))
+            {
+                std::replace(value.begin(), value.end(), 'x', ',');
+                std::vector<int> res = split_list<int>(value);
+                if (res.size() != 2 || res[0] < 1 || res[1] < 1)
+                    throw std::invalid_argument(value);
+                opt.bench_nx = res[0];
+                opt.bench_ny = res[1];
+            }
+            else if (option_value(arg, "--bench", value))
+                opt.bench_scenes = split_list<std::string>(value);
+            else if (option_value(arg, "--draft", value))
+            {
+                opt.draft = true;
+                if (!value.empty())
+                    opt.draft_step = std::stoi(value);
+            }
+            else
+            {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                print_usage();
+                return false;
+            }
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "Invalid value in option: " << argv[i] << std::endl;
+            return false;
+        }
+    }
+
+    if (!opt.bench_scenes.empty() || opt.bench_boxes)
+        return true;
+    for (auto *service : {&opt.worker, &opt.daemon, &opt.submit})
+    {
+        Endpoint ep;
+        if (service->empty())
+            continue;
+        if (!ep.parse(*service))
+        {
+            std::cerr << "Invalid endpoint: " << *service << std::endl;
+            return false;
+        }
+        if (opt.cache_size < 1)
+        {
+            std::cerr << "Cache size must be positive" << std::endl;
+            return false;
+        }
+        // these modes do not render a local scene
+        return true;
+    }
+    if (opt.scene_path.empty())
+    {
+        std::cerr << "No scene specified!" << std::endl;
+        print_usage();
+        return false;
+    }
+    // step 1 traces every pixel, a full render with extra work
+    if (opt.draft_step < 2)
+    {
+        std::cerr << "Draft step must be at least 2" << std::endl;
+        return false;
+    }
+    if (opt.sbvh >= 0 && opt.accel != "linear")
+    {
+        std::cerr << "--sbvh only applies to --accel=linear" << std::endl;
+        return false;
+    }
+    if (opt.draft && !opt.gbuffer_path.empty())
+    {
+        std::cerr << "--draft and --gbuffer cannot be combined" << std::endl;
+        return false;
+    }
+    if (opt.prev_scene.empty() != opt.prev_output.empty())
+    {
+        std::cerr << "--prev-scene and --prev-output must be given together"
+                  << std::endl;
+        return false;
+    }
+    if ((opt.record_deps || !opt.prev_scene.empty()) &&
+        (opt.draft || !opt.gbuffer_path.empty()))
+    {
+        std::cerr << "Incremental rendering cannot be combined with --draft "
+                     "or --gbuffer"
+                  << std::endl;
+        return false;
+    }
+#ifndef RT_TRACE
+    if (!opt.trace_path.empty())
+    {
+        std::cerr << "--trace needs a build with -DRT_TRACE (make TRACE=1)"
+                  << std::endl;
+        return false;
+    }
+#endif
+    if (!opt.trace_path.empty() &&
+        (!opt.bench_scenes.empty() || !opt.worker.empty() ||
+         !opt.daemon.empty() || !opt.submit.empty()))
+    {
+        std::cerr << "--trace only applies to local renders" << std::endl;
+        return false;
+    }
+    if (!opt.heatmap.empty() &&
+        (opt.draft || !opt.gbuffer_path.empty() || opt.record_deps ||
+         !opt.prev_scene.empty() || !opt.coordinator.empty() ||
+         opt.checkpoint))
+    {
+        std::cerr << "--heatmap only applies to full local renders"
+                  << std::endl;
+        return false;
+    }
+    if (opt.raster &&
+        (opt.draft || !opt.gbuffer_path.empty() || opt.record_deps ||
+         !opt.prev_scene.empty() || !opt.coordinator.empty() ||
+         !opt.heatmap.empty() || opt.checkpoint))
+    {
+        std::cerr << "--raster only applies to plain local renders"
+                  << std::endl;
+        return false;
+    }
+    if (opt.aov &&
+        (opt.draft || !opt.gbuffer_path.empty() || opt.record_deps ||
+         !opt.prev_scene.empty() || !opt.coordinator.empty() ||
+         !opt.heatmap.empty() || opt.checkpoint))
+    {
+        std::cerr << "--aov only applies to plain local renders" << std::endl;
+        return false;
+    }
+    if (opt.checkpoint &&
+        (opt.draft || !opt.gbuffer_path.empty() || opt.record_deps ||
+         !opt.prev_scene.empty()))
+    {
+        std::cerr << "--checkpoint only applies to full renders" << std::endl;
+        return false;
+    }
+    Endpoint ep;
+    if (!opt.coordinator.empty() &&
+        (!ep.parse(opt.coordinator) || opt.draft ||
+         !opt.gbuffer_path.empty() || opt.record_deps ||
+         !opt.prev_scene.empty() || opt.checkpoint))
+    {
+        std::cerr << "Invalid coordinator endpoint or combination: "
+                  << opt.coordinator << std::endl;
+        return false;
+    }
+    if (opt.checkpoint_interval < 1)
+    {
+        std::cerr << "Checkpoint interval must be positive" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// the options read by configure_scene as arguments for parse_options, so
+// that a worker builds the scene exactly like its coordinator
+std::vector<std::string> scene_args(const Options &opt)
+{
+    std::vector<std::string> args{"--accel=" + opt.accel};
+    auto number = [&args](const std::string &name, const double v) {
+        std::ostringstream ss;
+        ss.precision(17);
+        ss << name << '=' << v;
+        args.push_back(ss.str());
+    };
+    if (opt.weld >= 0)
+        number("--weld", opt.weld);
+    if (opt.sbvh >= 0)
+        number("--sbvh", opt.sbvh);
+    if (opt.light_cutoff > 0)
+        number("--light-cutoff", opt.light_cutoff);
+    return args;
+}
+
+#endif // OPTIONS_H
@@ -0,0 +1,172 @@
+#ifndef PERF_H
+#define PERF_H
+
+// Hardware counters through Linux perf_event_open, opened per thread for
+// the benchmark. Where they cannot be opened (other platforms, containers,
+// perf_event_paranoid) PerfCounters::open fails and nothing is counted.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfEvent
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENT_COUNT
+};
+
+static const char *const perf_event_names[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+struct PerfCounts
+{
+    uint64_t v[PERF_EVENT_COUNT]{};
+    // events that could be opened
+    bool valid[PERF_EVENT_COUNT]{};
+
+    bool any() const
+    {
+        for (bool b : valid)
+            if (b)
+                return true;
+        return false;
+    }
+
+    void add(const PerfCounts &c)
+    {
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+        {
+            v[e] += c.v[e];
+            valid[e] = valid[e] || c.valid[e];
+        }
+    }
+};
+
+// counters of the calling thread, user space only
+class PerfCounters
+{
+public:
+    PerfCounters() { std::fill(m_fd, m_fd + PERF_EVENT_COUNT, -1); }
+    ~PerfCounters() { close(); }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // opens what it can, errno of the last failure is left in error()
+    bool open()
+    {
+#ifdef __linux__
+        static const uint64_t l1d_read_miss =
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const uint32_t types[PERF_EVENT_COUNT] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+        const uint64_t configs[PERF_EVENT_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, l1d_read_miss,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+        bool any = false;
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            m_fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (m_fd[e] < 0)
+                m_error = errno;
+            else
+                any = true;
+        }
+        return any;
+#else
+        m_error = ENOSYS;
+        return false;
+#endif
+    }
+
+    // counts since open, scaled up when the kernel multiplexed an event
+    PerfCounts read() const
+    {
+        PerfCounts c;
+#ifdef __linux__
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+        {
+            uint64_t buf[3];
+            if (m_fd[e] < 0 || ::read(m_fd[e], buf, sizeof(buf)) != sizeof(buf))
+                continue;
+            c.v[e] = buf[2] ? uint64_t(double(buf[0]) * buf[1] / buf[2]) : 0;
+            c.valid[e] = true;
+        }
+#endif
+        return c;
+    }
+
+    void close()
+    {
+#ifdef __linux__
+        for (int &fd : m_fd)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    int error() const { return m_error; }
+
+private:
+    int m_fd[PERF_EVENT_COUNT];
+    int m_error = 0;
+};
+
+// set by the benchmark to count every parallel_for worker
+static bool perf_enabled = false;
+
+// per-thread counts of the parallel_for workers, merged like stats_total
+class PerfTotal
+{
+public:
+    void merge(const PerfCounts &c)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_threads.push_back(c);
+    }
+
+    std::vector<PerfCounts> take()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<PerfCounts> t;
+        t.swap(m_threads);
+        return t;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::vector<PerfCounts> m_threads;
+};
+
+static PerfTotal perf_total;
+
+#endif // PERF_H
@@ -0,0 +1,395 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "render.h"
+#include "scene.h"
+#include "image.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Hybrid primary visibility (--raster). Camera rays all start at the eye
+// and go through pixel centres, so instead of tracing them every triangle
+// of the scene (mesh and <triangle> objects) is projected through the
+// camera and rasterized into a buffer holding the nearest triangle of each
+// pixel. Shading then intersects the camera ray with that one triangle for
+// the exact hit, tests only the spheres, planes and custom objects in
+// front of it, and traces shadows and mirror bounces as usual.
+//
+// The triangles are set up and binned into screen tiles in chunks on all
+// threads, then each tile is rasterized by one thread in triangle order.
+// The pixel loop evaluates the edge functions and 1/depth for a row of
+// pixels without branches so that it vectorises.
+
+struct VisibilityBuffer
+{
+    static constexpr uint32_t NO_TRIANGLE = UINT32_MAX;
+
+    int nx{0}, ny{0};
+    // 1/z of the nearest triangle, z the distance along the gaze (0: none)
+    std::vector<double> inv_depth;
+    // its id, see Rasterizer::primitive
+    std::vector<uint32_t> id;
+};
+
+class Rasterizer
+{
+public:
+    explicit Rasterizer(const Scene &scene)
+        : m_scene{scene}, m_grid{scene.camera},
+          m_meshes{uint32_t(scene.triangles.size())}
+    {
+        // objects of the mesh triangles, a mesh owns everything from its
+        // first triangle to the next mesh (more than count with SBVH)
+        m_object.assign(m_meshes, 0);
+        uint32_t owner = 0;
+        std::vector<int> starts(m_meshes, -1);
+        for (size_t i = 0; i < scene.objects.size(); ++i)
+        {
+            const SceneObject &o = scene.objects[i];
+            if (o.type == PRIMITIVE_MESH && o.count)
+                starts[o.first] = i;
+        }
+        for (uint32_t k = 0; k < m_meshes; ++k)
+        {
+            if (starts[k] >= 0)
+                owner = starts[k];
+            m_object[k] = owner;
+        }
+
+        // camera space: d = a u + b v + c w, with z = -c in front
+        const Camera &cam = scene.camera;
+        vec3 vw = cross(cam.v, cam.w), wu = cross(cam.w, cam.u),
+             uv = cross(cam.u, cam.v);
+        double det = dot(cam.u, vw);
+        m_row[0] = vw / det;
+        m_row[1] = wu / det;
+        m_row[2] = uv / det;
+        m_du = (cam.np_r - cam.np_l) / cam.nx;
+        m_dv = (cam.np_t - cam.np_b) / cam.ny;
+        m_near = 1e-3 * cam.near_dist;
+    }
+
+    size_t triangles() const
+    {
+        return m_meshes + m_scene.single_triangles.size();
+    }
+
+    // object and primitive of a triangle id for Scene::hit_primitive
+    void primitive(const uint32_t id, int &object, int &primitive) const
+    {
+        if (id < m_meshes)
+        {
+            object = m_object[id];
+            primitive = id;
+            return;
+        }
+        object = m_scene.single_triangles.object[id - m_meshes];
+        primitive = -1;
+    }
+
+    // fills vis with the nearest triangle of every pixel, returns the
+    // number of triangles left after clipping and culling
+    size_t run(VisibilityBuffer &vis)
+    {
+        TRACE_SCOPE("rasterize");
+        vis.nx = m_scene.camera.nx;
+        vis.ny = m_scene.camera.ny;
+        vis.inv_depth.assign(size_t(vis.nx) * vis.ny, 0);
+        vis.id.assign(size_t(vis.nx) * vis.ny,
+                      VisibilityBuffer::NO_TRIANGLE);
+
+        size_t chunks = (triangles() + CHUNK - 1) / CHUNK;
+        m_chunks.assign(chunks, Chunk());
+        parallel_for(chunks, [&](const int c) { setup_chunk(c); });
+        parallel_for(m_grid.count(),
+                     [&](const int k) { raster_tile(k, vis); });
+
+        size_t n = 0;
+        for (const Chunk &c : m_chunks)
+            n += c.setups.size();
+        return n;
+    }
+
+private:
+    static const size_t CHUNK = 4096;
+
+    // a projected triangle: barycentric l_k = a[k] x + b[k] y + c[k] and
+    // 1/z = da x + db y + dc in pixel coordinates, over the pixels
+    // [x0, x1) x [y0, y1)
+    struct Setup
+    {
+        double a[3], b[3], c[3];
+        double da, db, dc;
+        int x0, y0, x1, y1;
+        uint32_t id;
+    };
+
+    // setups of CHUNK triangles and the ones overlapping each tile
+    struct Chunk
+    {
+        std::vector<Setup> setups;
+        std::vector<std::vector<uint32_t>> bins;
+    };
+
+    const Scene &m_scene;
+    TileGrid m_grid;
+    uint32_t m_meshes;
+    std::vector<uint32_t> m_object;
+    vec3 m_row[3];
+    double m_du, m_dv, m_near;
+    std::vector<Chunk> m_chunks;
+
+    void vertices(const uint32_t id, point3 p[3]) const
+    {
+        if (id < m_meshes)
+        {
+            const Triangle &t = m_scene.triangles[id];
+            p[0] = m_scene.positions[t.v0].point();
+            p[1] = m_scene.positions[t.v1].point();
+            p[2] = m_scene.positions[t.v2].point();
+            return;
+        }
+        const TriangleArray &s = m_scene.single_triangles;
+        size_t k = id - m_meshes;
+        p[0] = point3(s.ax[k], s.ay[k], s.az[k]);
+        p[1] = p[0] - vec3(s.abx[k], s.aby[k], s.abz[k]);
+        p[2] = p[0] - vec3(s.acx[k], s.acy[k], s.acz[k]);
+    }
+
+    // (a, b, z) of p, see the constructor
+    vec3 to_camera(const point3 &p) const
+    {
+        vec3 d = p - m_scene.camera.position;
+        return vec3(dot(d, m_row[0]), dot(d, m_row[1]), -dot(d, m_row[2]));
+    }
+
+    void setup_chunk(const int c)
+    {
+        Chunk &chunk = m_chunks[c];
+        chunk.bins.resize(m_grid.count());
+        size_t end = std::min(triangles(), (c + 1) * CHUNK);
+        for (uint32_t id = c * CHUNK; id < end; ++id)
+        {
+            point3 p[3];
+            vertices(id, p);
+            vec3 q[3] = {to_camera(p[0]), to_camera(p[1]),
+                         to_camera(p[2])};
+
+            // clip against z = m_near, leaving a triangle or a quad
+            vec3 poly[4];
+            int n = 0;
+            for (int k = 0; k < 3; ++k)
+            {
+                const vec3 &s = q[k], &e = q[(k + 1) % 3];
+                bool s_in = s.z >= m_near, e_in = e.z >= m_near;
+                if (s_in)
+                    poly[n++] = s;
+                if (s_in != e_in)
+                    poly[n++] =
+                        s + (e - s) * ((m_near - s.z) / (e.z - s.z));
+            }
+            for (int k = 1; k + 1 < n; ++k)
+                add(chunk, id, poly[0], poly[k], poly[k + 1]);
+        }
+    }
+
+    // projects one clipped triangle and bins it
+    void add(Chunk &chunk, const uint32_t id, const vec3 &q0, const vec3 &q1,
+             const vec3 &q2)
+    {
+        const Camera &cam = m_scene.camera;
+        double x[3], y[3], iz[3];
+        const vec3 *q[3] = {&q0, &q1, &q2};
+        for (int k = 0; k < 3; ++k)
+        {
+            double lambda = cam.near_dist / q[k]->z;
+            x[k] = (lambda * q[k]->x - cam.np_l) / m_du;
+            y[k] = (cam.np_r - lambda * q[k]->y) / m_dv;
+            iz[k] = 1 / q[k]->z;
+        }
+        double area = (x[1] - x[0]) * (y[2] - y[0]) -
+                      (x[2] - x[0]) * (y[1] - y[0]);
+        // edge-on, the camera rays miss it as well
+        if (std::fabs(area) < 1e-12)
+            return;
+
+        Setup s;
+        s.id = id;
+        for (int k = 0; k < 3; ++k)
+        {
+            // l_k is the signed area opposite vertex k over the whole area,
+            // for either winding
+            int i = (k + 1) % 3, j = (k + 2) % 3;
+            s.a[k] = (y[i] - y[j]) / area;
+            s.b[k] = (x[j] - x[i]) / area;
+            s.c[k] = (x[i] * y[j] - x[j] * y[i]) / area;
+        }
+        s.da = s.db = s.dc = 0;
+        for (int k = 0; k < 3; ++k)
+        {
+            s.da += s.a[k] * iz[k];
+            s.db += s.b[k] * iz[k];
+            s.dc += s.c[k] * iz[k];
+        }
+
+        // pixels whose centre can be inside
+        double lo_x = std::min({x[0], x[1], x[2]}),
+               hi_x = std::max({x[0], x[1], x[2]}),
+               lo_y = std::min({y[0], y[1], y[2]}),
+               hi_y = std::max({y[0], y[1], y[2]});
+        s.x0 = int(std::max(0.0, std::ceil(lo_x - 0.5)));
+        s.y0 = int(std::max(0.0, std::ceil(lo_y - 0.5)));
+        s.x1 = int(std::min(double(cam.nx), std::floor(hi_x - 0.5) + 1));
+        s.y1 = int(std::min(double(cam.ny), std::floor(hi_y - 0.5) + 1));
+        if (s.x0 >= s.x1 || s.y0 >= s.y1)
+            return;
+
+        uint32_t index = chunk.setups.size();
+        chunk.setups.push_back(s);
+        for (int ty = s.y0 / m_grid.size; ty <= (s.y1 - 1) / m_grid.size;
+             ++ty)
+            for (int tx = s.x0 / m_grid.size;
+                 tx <= (s.x1 - 1) / m_grid.size; ++tx)
+                chunk.bins[ty * m_grid.cols() + tx].push_back(index);
+    }
+
+    void raster_tile(const int k, VisibilityBuffer &vis) const
+    {
+        int x0, y0, x1, y1;
+        m_grid.bounds(k, x0, y0, x1, y1);
+        for (const Chunk &chunk : m_chunks)
+        {
+            for (uint32_t index : chunk.bins[k])
+            {
+                const Setup &s = chunk.setups[index];
+                int xa = std::max(x0, s.x0), xb = std::min(x1, s.x1);
+                int ya = std::max(y0, s.y0), yb = std::min(y1, s.y1);
+                for (int y = ya; y < yb; ++y)
+                {
+                    double yc = y + 0.5;
+                    double r0 = s.b[0] * yc + s.c[0],
+                           r1 = s.b[1] * yc + s.c[1],
+                           r2 = s.b[2] * yc + s.c[2],
+                           rz = s.db * yc + s.dc;
+                    const double a0 = s.a[0], a1 = s.a[1], a2 = s.a[2],
+                                 da = s.da;
+                    const uint32_t id = s.id;
+                    double *depth = &vis.inv_depth[size_t(y) * vis.nx];
+                    uint32_t *ids = &vis.id[size_t(y) * vis.nx];
+#pragma omp simd
+                    for (int x = xa; x < xb; ++x)
+                    {
+                        double xc = x + 0.5;
+                        double l0 = a0 * xc + r0, l1 = a1 * xc + r1,
+                               l2 = a2 * xc + r2, z = da * xc + rz;
+                        bool in = (l0 >= 0) & (l1 >= 0) & (l2 >= 0) &
+                                  (z > depth[x]);
+                        depth[x] = in ? z : depth[x];
+                        ids[x] = in ? id : ids[x];
+                    }
+                }
+            }
+        }
+    }
+};
+
+// closest hit of r with the spheres, planes and custom objects below t_max
+static bool hit_non_triangles(const Scene &scene, const ray &r,
+                              const double t_max, HitRecord &rec)
+{
+    HitRecord temp;
+    rec.t = t_max;
+    bool is_hit = false;
+    for (uint32_t i : scene.looped_objects)
+    {
+        if (scene.objects[i].type == PRIMITIVE_CUSTOM &&
+            scene.hit_object(i, r, 0, rec.t, temp) && temp.t < rec.t)
+        {
+            rec = temp;
+            is_hit = true;
+        }
+    }
+    if (scene.hit_shapes(scene.spheres, r, 0, rec.t, temp))
+    {
+        rec = temp;
+        is_hit = true;
+    }
+    if (scene.hit_shapes(scene.planes, r, 0, rec.t, temp))
+    {
+        rec = temp;
+        is_hit = true;
+    }
+    return is_hit;
+}
+
+// Rasterizes the primary visibility, then shades every tile from it
+void raytracing_raster(const Scene &scene, Image &img)
+{
+    TRACE_SCOPE("render");
+    auto start = std::chrono::high_resolution_clock::now();
+    Rasterizer raster(scene);
+    VisibilityBuffer vis;
+    size_t drawn = raster.run(vis);
+    auto rasterized = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    progress() << "Rasterized " << raster.triangles() << " triangles ("
+               << drawn << " on screen) in " << rasterized.count() / 1000.0
+               << " seconds.\n";
+
+    TileGrid grid(scene.camera);
+    progress() << "Shading " << grid.count() << " tiles on "
+               << thread_count() << " threads...\n";
+    // camera rays whose triangle missed, traced in full instead
+    std::atomic<uint64_t> traced{0};
+    parallel_for(grid.count(), [&](const int k) {
+        TRACE_SCOPE("tile", k);
+        int x0, y0, x1, y1;
+        grid.bounds(k, x0, y0, x1, y1);
+        uint64_t missed = 0;
+        for (int j = y0; j < y1; ++j)
+            for (int i = x0; i < x1; ++i)
+            {
+                ray r = scene.camera.ray_to_pixel(i, j);
+                ++ray_stats.primary;
+                HitRecord hit, temp;
+                bool is_hit = false;
+                uint32_t id = vis.id[size_t(j) * vis.nx + i];
+                if (id == VisibilityBuffer::NO_TRIANGLE)
+                    is_hit = hit_non_triangles(scene, r, INF, hit);
+                else
+                {
+                    int object, primitive;
+                    raster.primitive(id, object, primitive);
+                    is_hit = scene.hit_primitive(object, primitive, r, 0,
+                                                 INF, hit);
+                    if (!is_hit)
+                    {
+                        // the pixel centre is on an edge the ray misses
+                        ++missed;
+                        is_hit = scene.hit(r, 0, INF, hit);
+                    }
+                    else if (hit_non_triangles(scene, r, hit.t, temp))
+                        hit = temp;
+                }
+                img.set_pixel(i, j,
+                              shade_hit(scene, r, MAX_DEPTH, is_hit, hit,
+                                        nullptr));
+                write_aovs(scene, img, i, j, r, is_hit, hit);
+            }
+        traced += missed;
+    });
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    progress() << traced << " camera rays missed their triangle and were "
+                  "traced\n"
+               << "Rendering is completed in " << duration.count() / 1000.0
+               << " seconds.\n";
+}
+
+#endif // RASTER_H
@@ -9,6 +9,11 @@ public:
     {
         this->o = origin;
         this->d = direction;
+        // inf for a zero component, the slab tests rely on that
+        this->inv_d = vec3(1.0 / d.x, 1.0 / d.y, 1.0 / d.z);
+        this->neg[0] = inv_d.x < 0;
+        this->neg[1] = inv_d.y < 0;
+        this->neg[2] = inv_d.z < 0;
     }
 
     inline point3 origin() const
@@ -19,6 +24,16 @@ public:
     {
         return d;
     }
+    // 1 / direction, per component
+    inline const vec3 &inv_direction() const
+    {
+        return inv_d;
+    }
+    // 1 when the direction is negative along axis a
+    inline int sign(const int a) const
+    {
+        return neg[a];
+    }
 
     inline point3 at(const double t) const
     {
@@ -28,6 +43,8 @@ public:
 private:
     point3 o;
     vec3 d;
+    vec3 inv_d;
+    int neg[3];
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,621 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "ray.h"
+#include "scene.h"
+#include "image.h"
+#include "helpers.h"
+#include "deps.h"
+#include "stats.h"
+#include "perf.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#define EPS 0.0000001
+
+static const int MAX_DEPTH = 6;
+
+// worker threads used by parallel_for, 0 means one per hardware thread
+static unsigned int render_threads = 0;
+// drops the progress messages, set while benchmarking to stdout
+static bool render_quiet = false;
+
+// stream of the progress messages, stdout unless render_quiet
+std::ostream &progress()
+{
+    static std::ostream null{nullptr};
+    return render_quiet ? null : std::cout;
+}
+
+inline unsigned int thread_count()
+{
+    unsigned int n = render_threads ? render_threads
+                                    : std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Last primitive that blocked each light on this thread. Neighbouring
+// shaded points usually share their occluder, so shade_direct tests it
+// before a full occlusion query. Entries are only hints: a stale one just
+// misses.
+struct ShadowCache
+{
+    const Scene *scene{nullptr};
+    std::vector<std::pair<int, int>> blocker;
+
+    std::pair<int, int> &of(const Scene &s, const size_t light)
+    {
+        if (scene != &s || blocker.size() != s.lights.size())
+        {
+            scene = &s;
+            blocker.assign(s.lights.size(), {-1, -1});
+        }
+        return blocker[light];
+    }
+};
+
+static thread_local ShadowCache shadow_cache;
+// off with --no-shadow-cache
+static bool shadow_cache_enabled = true;
+
+// whether anything blocks the shadow ray s closer than dist, trying the
+// last blocker of the light first
+static bool occluded_cached(const Scene &scene, const size_t light,
+                            const ray &s, const double dist, HitRecord &rec)
+{
+    if (!shadow_cache_enabled)
+        return scene.occluded(s, dist, rec);
+    std::pair<int, int> &last = shadow_cache.of(scene, light);
+    if (last.first >= 0)
+    {
+        ++ray_stats.shadow_cache_tests;
+        if (scene.hit_primitive(last.first, last.second, s, 0, INF, rec) &&
+            len(s.at(rec.t) - s.origin()) < dist)
+        {
+            ++ray_stats.shadow_cache_hits;
+            return true;
+        }
+    }
+    // a lit point forgets the blocker, its neighbours are likely lit too
+    bool shadow = scene.occluded(s, dist, rec);
+    last = shadow ? std::make_pair(rec.object, rec.primitive)
+                  : std::make_pair(-1, -1);
+    return shadow;
+}
+
+// ambient term plus the unoccluded contribution of every point light at x
+// that is within its influence radius, w_o is the unit direction from x to
+// the camera
+color shade_direct(const Scene &scene, const point3 &x, const vec3 &n,
+                   const vec3 &w_o, const Material &mat)
+{
+    color c = mat.ambient * scene.ambient;
+
+    // a culled light still matters once it moves closer or gets brighter
+    if (tile_deps)
+        for (size_t i = 0; i < scene.lights.size(); ++i)
+            tile_deps->light(i);
+
+    const uint32_t *first, *last;
+    scene.light_index.query(x, first, last);
+    ray_stats.lights_culled += scene.lights.size() - (last - first);
+    for (const uint32_t *it = first; it != last; ++it)
+    {
+        const Pointlight &l = scene.lights[*it];
+        vec3 l_to_x = l.position - x;
+        if (!scene.light_index.reaches(*it, l_to_x))
+        {
+            ++ray_stats.lights_culled;
+            continue;
+        }
+        vec3 w_i = unit_vec(l_to_x);
+        double dist_l = len(l_to_x);
+        ray s = ray(x + EPS * w_i, w_i);
+        ++ray_stats.shadow;
+
+        HitRecord shadow_rec;
+        bool shadow = occluded_cached(scene, *it, s, dist_l, shadow_rec);
+
+        if (tile_deps)
+        {
+            tile_deps->segment(x, l.position);
+            if (shadow)
+                tile_deps->object(shadow_rec.object);
+        }
+
+        if (!shadow)
+        {
+            color E_i = l.intensity / (dist_l * dist_l);
+            double cos_t = max(0, dot(n, w_i));
+
+            c += mat.diffuse * cos_t * E_i;
+
+            vec3 h = unit_vec(w_i + w_o);
+
+            double cos_a = max(0, dot(n, h));
+
+            c += mat.specular * phong_pow(cos_a, mat.phong_exp) * E_i;
+        }
+    }
+    return c;
+}
+
+// off with --no-primary-cache
+static bool primary_cache_enabled = true;
+
+// closest hit of the camera ray r. The primitive hit by the previous
+// pixel (last) is tested first and its distance bounds the full query,
+// which then prunes everything behind it. The bound is a little past that
+// distance, so the query finds the same hit it would without it, even
+// through boxes whose slab distances are rounded differently.
+static bool hit_primary(const Scene &scene, const ray &r,
+                        const HitRecord &last, HitRecord &rec)
+{
+    HitRecord cached;
+    double t_max = INF;
+    if (primary_cache_enabled && last.object >= 0)
+    {
+        ++ray_stats.primary_cache_tests;
+        if (scene.hit_primitive(last.object, last.primitive, r, 0, INF,
+                                cached))
+        {
+            ++ray_stats.primary_cache_hits;
+            t_max = cached.t * (1 + 1e-9);
+        }
+    }
+    if (scene.hit(r, 0, t_max, rec))
+        return true;
+    rec = cached;
+    return t_max < INF;
+}
+
+color shade_hit(const Scene &scene, const ray &r, const int depth,
+                const bool is_hit, const HitRecord &closest_hit,
+                HitRecord *primary);
+
+// primary (optional) receives the first hit of r, primary->object stays
+// -1 when r escapes to the background. last (optional) is the first hit of
+// the previous camera ray, see hit_primary.
+color ray_color(const Scene &scene, const ray &r, const int depth,
+                HitRecord *primary = nullptr,
+                const HitRecord *last = nullptr)
+{
+    HitRecord closest_hit;
+    ++(depth == MAX_DEPTH ? ray_stats.primary : ray_stats.reflection);
+
+    bool is_hit = last ? hit_primary(scene, r, *last, closest_hit)
+                       : scene.hit(r, 0, INF, closest_hit);
+    return shade_hit(scene, r, depth, is_hit, closest_hit, primary);
+}
+
+// colour of r given its first hit, found by ray_color or by the caller
+// (see raster.h), the background when there is none
+color shade_hit(const Scene &scene, const ray &r, const int depth,
+                const bool is_hit, const HitRecord &closest_hit,
+                HitRecord *primary)
+{
+    if (is_hit)
+    {
+        if (primary)
+            *primary = closest_hit;
+        if (tile_deps)
+        {
+            tile_deps->object(closest_hit.object);
+            tile_deps->material(scene.objects[closest_hit.object].mat_id);
+            tile_deps->segment(r.origin(), r.at(closest_hit.t));
+        }
+
+        vec3 n = unit_vec(closest_hit.normal);
+        point3 x = r.at(closest_hit.t);
+        const Material &mat = scene.material_of(closest_hit);
+
+        vec3 w_o = unit_vec(scene.camera.position - x);
+        color c = shade_direct(scene, x, n, w_o, mat);
+
+        if (len(mat.mirror_refl) > 0 && depth > 0)
+        {
+            vec3 w_r = -w_o + 2 * n * dot(n, w_o);
+            c += mat.mirror_refl *
+                 ray_color(scene, ray(x + w_r * EPS, w_r), depth - 1);
+        }
+        return c;
+    }
+
+    if (primary)
+        *primary = HitRecord();
+    if (tile_deps)
+        tile_deps->escaped(r);
+    return scene.background;
+}
+
+// runs job(k) for k in [0, n) on thread_count() threads, handing out
+// indices one at a time
+template <typename Job>
+void parallel_for(const int n, Job job)
+{
+    const unsigned int nThreads = thread_count();
+    std::atomic<int> next{0};
+
+    std::vector<std::thread> th{nThreads};
+    for (unsigned int i = 0; i < nThreads; ++i)
+    {
+        th[i] = std::thread([&]() {
+            PerfCounters perf;
+            bool counting = perf_enabled && perf.open();
+            for (int k = next++; k < n; k = next++)
+                job(k);
+            stats_total.merge(ray_stats);
+            if (counting)
+                perf_total.merge(perf.read());
+        });
+    }
+    for (unsigned int i = 0; i < nThreads; ++i)
+    {
+        th[i].join();
+    }
+}
+
+static const int TILE_SIZE = 32;
+
+struct TileGrid
+{
+    int nx, ny, size;
+
+    explicit TileGrid(const Camera &cam, const int tile_size = TILE_SIZE)
+        : nx{cam.nx}, ny{cam.ny}, size{tile_size}
+    {
+    }
+
+    int cols() const { return (nx + size - 1) / size; }
+    int rows() const { return (ny + size - 1) / size; }
+    int count() const { return cols() * rows(); }
+
+    // pixel range [x0,x1)x[y0,y1) of tile k
+    void bounds(const int k, int &x0, int &y0, int &x1, int &y1) const
+    {
+        x0 = (k % cols()) * size;
+        y0 = (k / cols()) * size;
+        x1 = std::min(x0 + size, nx);
+        y1 = std::min(y0 + size, ny);
+    }
+};
+
+// AOV layers added by add_aovs, in this order
+enum Aov
+{
+    AOV_DEPTH,
+    AOV_NORMAL,
+    AOV_ALBEDO,
+    AOV_ID,
+};
+
+// adds the layers written by --aov to img
+void add_aovs(Image &img)
+{
+    img.add_layer("depth", 1);
+    img.add_layer("normal", 3);
+    img.add_layer("albedo", 3);
+    img.add_layer("id", 3);
+}
+
+// Fills the AOVs of pixel (i, j) from the first hit of its camera ray r,
+// nothing when img has none. depth is the distance from the camera,
+// normal the unit world space normal, albedo the diffuse reflectance and
+// id the object, material and triangle indices. A pixel showing the
+// background keeps depth, normal and albedo at 0 and has ids of -1.
+void write_aovs(const Scene &scene, Image &img, const int i, const int j,
+                const ray &r, const bool is_hit, const HitRecord &hit)
+{
+    if (!img.has_layers())
+        return;
+    float depth = 0, normal[3] = {0, 0, 0}, albedo[3] = {0, 0, 0},
+          id[3] = {-1, -1, -1};
+    if (is_hit)
+    {
+        depth = float(hit.t * len(r.direction()));
+        vec3 n = unit_vec(hit.normal);
+        const color &kd = scene.material_of(hit).diffuse;
+        for (int c = 0; c < 3; ++c)
+        {
+            normal[c] = float(n[c]);
+            albedo[c] = float(kd[c]);
+        }
+        id[0] = float(hit.object);
+        id[1] = float(hit.material);
+        id[2] = float(hit.primitive);
+    }
+    img.set_layer(AOV_DEPTH, i, j, &depth);
+    img.set_layer(AOV_NORMAL, i, j, normal);
+    img.set_layer(AOV_ALBEDO, i, j, albedo);
+    img.set_layer(AOV_ID, i, j, id);
+}
+
+// off with --no-batch-shading
+static bool batch_shading_enabled = true;
+
+// Camera ray hits of a tile row, lit together by shade_batch. Hit points,
+// normals, directions to the camera and material values are kept as one
+// array per component, so lighting every hit by one light is a loop
+// without branches that the compiler vectorises.
+struct ShadeBatch
+{
+    static const int SIZE = TILE_SIZE;
+
+    int n{0};
+    int pixel[SIZE];
+    const Material *mat[SIZE];
+    double px[SIZE], py[SIZE], pz[SIZE];
+    double nx[SIZE], ny[SIZE], nz[SIZE];
+    // unit direction to the camera
+    double ox[SIZE], oy[SIZE], oz[SIZE];
+    double kd[3][SIZE], ks[3][SIZE], phong_exp[SIZE];
+    // the exponent as an integer and its squarings for the fast Phong
+    // power, bits is -1 for std::pow (see phong_bits)
+    int int_exp[SIZE], bits[SIZE];
+    // colour so far, starting with the ambient term
+    double c[3][SIZE];
+
+    void add(const Scene &scene, const int i, const ray &r,
+             const HitRecord &h)
+    {
+        vec3 nv = unit_vec(h.normal);
+        point3 x = r.at(h.t);
+        vec3 w_o = unit_vec(scene.camera.position - x);
+        const Material &m = scene.material_of(h);
+        color a = m.ambient * scene.ambient;
+
+        pixel[n] = i;
+        mat[n] = &m;
+        px[n] = x.x, py[n] = x.y, pz[n] = x.z;
+        nx[n] = nv.x, ny[n] = nv.y, nz[n] = nv.z;
+        ox[n] = w_o.x, oy[n] = w_o.y, oz[n] = w_o.z;
+        kd[0][n] = m.diffuse.x, kd[1][n] = m.diffuse.y;
+        kd[2][n] = m.diffuse.z;
+        ks[0][n] = m.specular.x, ks[1][n] = m.specular.y;
+        ks[2][n] = m.specular.z;
+        phong_exp[n] = m.phong_exp;
+        bits[n] = phong_bits(m.phong_exp);
+        int_exp[n] = bits[n] >= 0 ? int(m.phong_exp) : 0;
+        c[0][n] = a.x, c[1][n] = a.y, c[2][n] = a.z;
+        ++n;
+    }
+
+    point3 point(const int k) const { return point3(px[k], py[k], pz[k]); }
+    vec3 normal(const int k) const { return vec3(nx[k], ny[k], nz[k]); }
+    color value(const int k) const
+    {
+        return color(c[0][k], c[1][k], c[2][k]);
+    }
+};
+
+// adds the direct light of every light to the hits of b, the same sums in
+// the same order as shade_direct
+void shade_batch(const Scene &scene, ShadeBatch &b)
+{
+    const size_t lights = scene.lights.size();
+    // candidate hits of every light, and the lights with any
+    static thread_local std::vector<uint8_t> candidate;
+    static thread_local std::vector<uint32_t> used;
+    if (candidate.size() < lights * ShadeBatch::SIZE)
+        candidate.assign(lights * ShadeBatch::SIZE, 0);
+    used.clear();
+    for (int k = 0; k < b.n; ++k)
+    {
+        const uint32_t *first, *last;
+        scene.light_index.query(b.point(k), first, last);
+        ray_stats.lights_culled += lights - (last - first);
+        for (const uint32_t *it = first; it != last; ++it)
+        {
+            uint8_t *row = &candidate[*it * ShadeBatch::SIZE];
+            if (std::find(row, row + ShadeBatch::SIZE, 1) ==
+                row + ShadeBatch::SIZE)
+                used.push_back(*it);
+            row[k] = 1;
+        }
+    }
+    std::sort(used.begin(), used.end());
+
+    int max_bits = 0;
+    for (int k = 0; k < b.n; ++k)
+        max_bits = std::max(max_bits, b.bits[k]);
+
+    double lit[ShadeBatch::SIZE], cos_t[ShadeBatch::SIZE],
+        cos_a[ShadeBatch::SIZE], e[ShadeBatch::SIZE], spec[ShadeBatch::SIZE];
+    for (uint32_t i : used)
+    {
+        const Pointlight &l = scene.lights[i];
+        uint8_t *row = &candidate[i * ShadeBatch::SIZE];
+
+        // shadow rays, one at a time
+        bool any = false;
+        for (int k = 0; k < b.n; ++k)
+        {
+            lit[k] = 0;
+            if (!row[k])
+                continue;
+            row[k] = 0;
+            point3 x = b.point(k);
+            vec3 l_to_x = l.position - x;
+            if (!scene.light_index.reaches(i, l_to_x))
+            {
+                ++ray_stats.lights_culled;
+                continue;
+            }
+            vec3 w_i = unit_vec(l_to_x);
+            ray s = ray(x + EPS * w_i, w_i);
+            ++ray_stats.shadow;
+            HitRecord shadow_rec;
+            lit[k] = !occluded_cached(scene, i, s, len(l_to_x), shadow_rec);
+            any |= lit[k] != 0;
+        }
+        if (!any)
+            continue;
+
+        const double lx = l.position.x, ly = l.position.y, lz = l.position.z;
+#pragma omp simd
+        for (int k = 0; k < b.n; ++k)
+        {
+            double dx = lx - b.px[k], dy = ly - b.py[k], dz = lz - b.pz[k];
+            double d = std::sqrt(dx * dx + dy * dy + dz * dz);
+            double inv_d = 1 / d;
+            double wx = inv_d * dx, wy = inv_d * dy, wz = inv_d * dz;
+            double ct = b.nx[k] * wx + b.ny[k] * wy + b.nz[k] * wz;
+            cos_t[k] = 0 > ct ? 0 : ct;
+            e[k] = 1 / (d * d);
+
+            double hx = wx + b.ox[k], hy = wy + b.oy[k], hz = wz + b.oz[k];
+            double inv_h = 1 / std::sqrt(hx * hx + hy * hy + hz * hz);
+            double ca = b.nx[k] * (inv_h * hx) + b.ny[k] * (inv_h * hy) +
+                        b.nz[k] * (inv_h * hz);
+            cos_a[k] = 0 > ca ? 0 : ca;
+        }
+
+        // cos_a^phong_exp by squaring in every lane, see phong_pow
+#pragma omp simd
+        for (int k = 0; k < b.n; ++k)
+        {
+            double p = 1, base = cos_a[k];
+            for (int bit = 0; bit < max_bits; ++bit, base *= base)
+                p = (b.int_exp[k] >> bit) & 1 ? p * base : p;
+            spec[k] = p;
+        }
+        for (int k = 0; k < b.n; ++k)
+            if (b.bits[k] < 0)
+                spec[k] = std::pow(cos_a[k], b.phong_exp[k]);
+
+        const double I[3] = {l.intensity.x, l.intensity.y, l.intensity.z};
+        for (int ch = 0; ch < 3; ++ch)
+        {
+            const double *kd = b.kd[ch], *ks = b.ks[ch];
+            double *c = b.c[ch];
+#pragma omp simd
+            for (int k = 0; k < b.n; ++k)
+            {
+                double E = e[k] * I[ch];
+                double diffuse = c[k] + kd[k] * cos_t[k] * E;
+                double lit_c = diffuse + ks[k] * spec[k] * E;
+                c[k] = lit[k] != 0 ? lit_c : c[k];
+            }
+        }
+    }
+}
+
+void render_tile(const Scene &scene, Image &img, const TileGrid &grid,
+                 const int k)
+{
+    TRACE_SCOPE("tile", k);
+    int x0, y0, x1, y1;
+    grid.bounds(k, x0, y0, x1, y1);
+    // first hit of the previous pixel
+    HitRecord last, hit;
+    if (tile_deps || !batch_shading_enabled)
+    {
+        for (int j = y0; j < y1; ++j)
+            for (int i = x0; i < x1; ++i)
+            {
+                ray r = scene.camera.ray_to_pixel(i, j);
+                img.set_pixel(i, j,
+                              ray_color(scene, r, MAX_DEPTH, &hit, &last));
+                write_aovs(scene, img, i, j, r, hit.object >= 0, hit);
+                last = hit;
+            }
+        return;
+    }
+
+    // lights the hits of the batch, then adds their mirror reflections
+    ShadeBatch batch;
+    auto flush = [&](const int j) {
+        shade_batch(scene, batch);
+        for (int b = 0; b < batch.n; ++b)
+        {
+            color c = batch.value(b);
+            const Material &mat = *batch.mat[b];
+            if (len(mat.mirror_refl) > 0)
+            {
+                vec3 n = batch.normal(b);
+                vec3 w_o(batch.ox[b], batch.oy[b], batch.oz[b]);
+                vec3 w_r = -w_o + 2 * n * dot(n, w_o);
+                c += mat.mirror_refl *
+                     ray_color(scene, ray(batch.point(b) + w_r * EPS, w_r),
+                               MAX_DEPTH - 1);
+            }
+            img.set_pixel(batch.pixel[b], j, c);
+        }
+        batch.n = 0;
+    };
+    for (int j = y0; j < y1; ++j)
+    {
+        for (int i = x0; i < x1; ++i)
+        {
+            ray r = scene.camera.ray_to_pixel(i, j);
+            ++ray_stats.primary;
+            if (!hit_primary(scene, r, last, hit))
+            {
+                last = HitRecord();
+                img.set_pixel(i, j, scene.background);
+                write_aovs(scene, img, i, j, r, false, hit);
+                continue;
+            }
+            write_aovs(scene, img, i, j, r, true, hit);
+            last = hit;
+            batch.add(scene, i, r, hit);
+            if (batch.n == ShadeBatch::SIZE)
+                flush(j);
+        }
+        flush(j);
+    }
+}
+
+// Renders every tile, or only the tiles whose mask entry is set. When
+// records is given, the dependencies of each rendered tile are stored in it.
+// tile_done is called from the worker thread once a tile is final in img.
+void raytracing_threaded(const Scene &scene, Image &img,
+                         const std::vector<char> *mask = nullptr,
+                         std::vector<TileRecord> *records = nullptr,
+                         const std::function<void(int)> &tile_done = nullptr)
+{
+    TRACE_SCOPE("render");
+    TileGrid grid(scene.camera);
+    std::vector<int> todo;
+    for (int k = 0; k < grid.count(); ++k)
+        if (!mask || (*mask)[k])
+            todo.push_back(k);
+
+    progress() << "Rendering " << todo.size() << " of " << grid.count()
+               << " tiles on " << thread_count() << " threads...\n";
+
+    DepsContext deps_ctx(scene);
+    if (records)
+        records->resize(grid.count());
+
+    auto start = std::chrono::high_resolution_clock::now();
+    parallel_for(todo.size(), [&](const int t) {
+        int k = todo[t];
+        if (!records)
+        {
+            render_tile(scene, img, grid, k);
+        }
+        else
+        {
+            DepsRecorder recorder(deps_ctx);
+            tile_deps = &recorder;
+            render_tile(scene, img, grid, k);
+            tile_deps = nullptr;
+            (*records)[k] = recorder.finish();
+        }
+        if (tile_done)
+            tile_done(k);
+    });
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - start);
+    progress() << "Rendering is completed in " << duration.count() / 1000.0
+               << " seconds.\n";
+}
+
+#endif // RENDER_H
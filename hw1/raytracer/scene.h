@@ -1,8 +1,22 @@
 #pragma once
 
 #include "camera.h"
+#include "arena.h"
+#include "bvh.h"
 #include "hittable.h"
+#include "lights.h"
+#include "mesh.h"
+#include "shapes.h"
+#include "stats.h"
+#include "trace.h"
 #include "vec3.h"
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <utility>
 #include <vector>
 #include <string>
 
@@ -15,29 +29,347 @@ struct Material
 
 struct Pointlight
 {
+    std::string id;
     point3 position;
     color intensity;
 };
 
+// Kinds of primitive. Each kind with a fast path has its own contiguous
+// array in Scene: mesh triangles are tested object by object in
+// Scene::hit_object, the analytic shapes of shapes.h all at once by their
+// SoA kernels. Anything else can be added as a PRIMITIVE_CUSTOM Hittable.
+enum PrimitiveType
+{
+    PRIMITIVE_MESH,
+    PRIMITIVE_TRIANGLE,
+    PRIMITIVE_SPHERE,
+    PRIMITIVE_PLANE,
+    PRIMITIVE_CUSTOM
+};
+
+// One object of the scene file: count primitives starting at first in the
+// array of its type (for custom objects, its index in Scene::custom)
+struct SceneObject
+{
+    PrimitiveType type;
+    uint32_t first, count;
+    std::string mat_id;
+    // index of mat_id in Scene::materials and the bounds, set by build()
+    int material{-1};
+    AxisAlignedBoundingBox box;
+    // root of a mesh's hierarchy in Scene::bvh_nodes, set by build()
+    uint32_t node{0};
+};
+
+struct Scene;
+
+// Search structure over the mesh triangles of a scene, see accel.h. When a
+// scene has one, Scene::hit asks it instead of testing the meshes one by
+// one through their BVHs.
+class Accelerator
+{
+public:
+    virtual ~Accelerator() = default;
+
+    // called by Scene::build once the meshes are loaded
+    virtual void build(const Scene &scene) = 0;
+
+    // closest mesh hit of r in (t_min, t_max), with its object and material
+    virtual bool hit(const Scene &scene, const ray &r, const double t_min,
+                     const double t_max, HitRecord &rec) const = 0;
+
+    // memory of the structure
+    virtual size_t bytes() const = 0;
+
+    // --accel name
+    virtual const char *name() const = 0;
+};
+
 struct Scene
 {
+    // Owns the storage of the containers below, which must all allocate
+    // from it. Declared first so it is destroyed last, handing every
+    // chunk back in one go. Ids are short enough to stay inside their
+    // std::string.
+    SceneArena arena;
+
     Camera camera;
     color background, ambient;
-    std::vector<Pointlight> lights;
-    std::vector<Material> materials;
-    std::vector<Hittable *> hittables;
-    std::vector<point3> vertices;
+    ArenaVector<Pointlight> lights{arena.resource()};
+    // lights that can reach a point, see lights.h
+    LightIndex light_index{arena.resource()};
+    ArenaVector<Material> materials{arena.resource()};
+    ArenaVector<SceneObject> objects{arena.resource()};
+    // XML id and fingerprint of every object, in the same order
+    ArenaVector<std::string> object_ids{arena.resource()};
+    ArenaVector<uint64_t> object_hashes{arena.resource()};
+    // primitives of all objects, grouped by type
+    ArenaVector<Vertex> positions{arena.resource()};
+    ArenaVector<Triangle> triangles{arena.resource()};
+    // the wide BVHs of all meshes, see bvh.h
+    ArenaVector<BVHNode> bvh_nodes{arena.resource()};
+    TriangleArray single_triangles{arena.resource()};
+    SphereArray spheres{arena.resource()};
+    PlaneArray planes{arena.resource()};
+    // custom primitives are constructed in the arena too
+    ArenaVector<Hittable *> custom{arena.resource()};
+    // mesh and custom objects tested one by one, only the custom ones with
+    // an accelerator
+    ArenaVector<uint32_t> looped_objects{arena.resource()};
+    // set before loading to search the meshes with a grid or octree instead
+    std::unique_ptr<Accelerator> accel;
+    // fingerprints of vertices and objects and of the whole scene file, set
+    // by scene_from_xml_file
+    uint64_t geometry_hash{0};
+    uint64_t source_hash{0};
+    // set before loading: mesh vertices closer than weld share one
+    // position (0 merges exact duplicates), negative keeps them all
+    double weld{-1};
+    // set before loading: spatial split budget of the mesh BVHs as a
+    // fraction of extra triangle references, negative for object splits
+    double sbvh{-1};
+    // set before loading: lights contributing less than light_cutoff
+    // colour levels are skipped, negative shades every light
+    double light_cutoff{-1};
+    // SAH cost of the mesh BVHs summed over the meshes, set by build()
+    double bvh_sah{0};
+    // vertices of the scene file and how many of them the meshes use,
+    // positions holds fewer when some were welded
+    size_t file_vertices{0}, mesh_vertices{0};
+
+    Scene() = default;
+    Scene(const Scene &) = delete;
+    Scene &operator=(const Scene &) = delete;
+
+    // the arena does not run destructors, only custom primitives need one
+    ~Scene()
+    {
+        for (auto h : custom)
+            h->~Hittable();
+    }
+
+    // tris index positions
+    void add_mesh(const std::string &id, const std::string &mat_id,
+                  const std::vector<Triangle> &tris, const uint64_t hash)
+    {
+        objects.push_back({PRIMITIVE_MESH, uint32_t(triangles.size()),
+                           uint32_t(tris.size()), mat_id});
+        triangles.insert(triangles.end(), tris.begin(), tris.end());
+        add_id(id, hash);
+    }
+
+    void add_triangle(const std::string &id, const std::string &mat_id,
+                      const point3 &v0, const point3 &v1, const point3 &v2,
+                      const uint64_t hash)
+    {
+        objects.push_back({PRIMITIVE_TRIANGLE,
+                           uint32_t(single_triangles.size()), 1, mat_id});
+        single_triangles.add(v0, v1, v2, objects.size() - 1);
+        add_id(id, hash);
+    }
+
+    void add_sphere(const std::string &id, const std::string &mat_id,
+                    const point3 &center, const double radius,
+                    const uint64_t hash)
+    {
+        objects.push_back(
+            {PRIMITIVE_SPHERE, uint32_t(spheres.size()), 1, mat_id});
+        spheres.add(center, radius, objects.size() - 1);
+        add_id(id, hash);
+    }
+
+    void add_plane(const std::string &id, const std::string &mat_id,
+                   const point3 &p, const vec3 &normal, const uint64_t hash)
+    {
+        objects.push_back(
+            {PRIMITIVE_PLANE, uint32_t(planes.size()), 1, mat_id});
+        planes.add(p, normal, objects.size() - 1);
+        add_id(id, hash);
+    }
 
-    Material get_material(std::string id) const
+    // constructs a T (a Hittable) from args in the arena
+    template <typename T, typename... Args>
+    T &add_custom(const std::string &id, const std::string &mat_id,
+                  const uint64_t hash, Args &&...args)
     {
-        for (auto &mat : materials)
+        void *p = arena.resource()->allocate(sizeof(T), alignof(T));
+        T *h = new (p) T(std::forward<Args>(args)...);
+        objects.push_back(
+            {PRIMITIVE_CUSTOM, uint32_t(custom.size()), 1, mat_id});
+        custom.push_back(h);
+        add_id(id, hash);
+        return *h;
+    }
+
+    // resolves materials, computes the bounds of every object and builds
+    // the mesh hierarchies (or the accelerator when there is one), called
+    // once the geometry is loaded. Afterwards the triangles of a mesh are
+    // in leaf order, with spatial splits some of them twice.
+    void build()
+    {
+        TRACE_SCOPE("build");
+        looped_objects.clear();
+        // built outside the arena so they are not grown there
+        std::vector<BVHNode> nodes;
+        std::vector<Triangle> leaves;
+        bvh_sah = 0;
+        for (size_t i = 0; i < objects.size(); ++i)
         {
-            if (mat.id == id)
+            SceneObject &o = objects[i];
+            o.material = material_index(o.mat_id);
+            switch (o.type)
             {
-                return mat;
+            case PRIMITIVE_MESH:
+                o.box = triangle_bounds(positions.data(),
+                                        &triangles[o.first], o.count);
+                if (o.count && !accel)
+                {
+                    BVHBuilder bvh(positions.data(), &triangles[o.first],
+                                   o.count, nodes, sbvh);
+                    o.first = leaves.size();
+                    o.node = bvh.build(leaves);
+                    bvh_sah += bvh.sah();
+                }
+                if (!accel)
+                    looped_objects.push_back(i);
+                break;
+            case PRIMITIVE_TRIANGLE:
+                o.box = single_triangles.bounds(o.first);
+                break;
+            case PRIMITIVE_SPHERE:
+                o.box = spheres.bounds(o.first);
+                break;
+            case PRIMITIVE_PLANE:
+                o.box = planes.bounds(o.first);
+                break;
+            case PRIMITIVE_CUSTOM:
+                custom[o.first]->boundingBoxInit();
+                o.box = custom[o.first]->boundingBox();
+                looped_objects.push_back(i);
+                break;
             }
         }
-        return Material();
+        bvh_nodes.assign(nodes.begin(), nodes.end());
+        if (!accel)
+            triangles.assign(leaves.begin(), leaves.end());
+        else
+            accel->build(*this);
+        single_triangles.pad();
+        spheres.pad();
+        planes.pad();
+
+        double reflectance = 0;
+        for (const Material &m : materials)
+            reflectance = std::max({reflectance, m.diffuse.x + m.specular.x,
+                                    m.diffuse.y + m.specular.y,
+                                    m.diffuse.z + m.specular.z});
+        light_index.build(lights, reflectance, light_cutoff);
+    }
+
+    size_t object_primitives(const size_t i) const
+    {
+        const SceneObject &o = objects[i];
+        return o.type == PRIMITIVE_CUSTOM ? custom[o.first]->primitiveCount()
+                                          : o.count;
+    }
+
+    size_t primitive_count() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < objects.size(); ++i)
+            n += object_primitives(i);
+        return n;
+    }
+
+    int material_index(const std::string &id) const
+    {
+        for (size_t i = 0; i < materials.size(); ++i)
+        {
+            if (materials[i].id == id)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // closest hit of r with the mesh or custom object objects[i], charging
+    // its tests to object_costs when profiling
+    bool hit_object(const size_t i, const ray &r, const double t_min,
+                    const double t_max, HitRecord &rec) const
+    {
+        RayStats before;
+        if (object_costs)
+            before = ray_stats;
+
+        const SceneObject &o = objects[i];
+        bool is_hit = false;
+        switch (o.type)
+        {
+        case PRIMITIVE_MESH:
+            ++ray_stats.box_tests;
+            if (!o.count || !o.box.hit(r, t_min, t_max))
+                break;
+            is_hit = hit_bvh(bvh_nodes.data(), o.node, positions.data(),
+                             &triangles[o.first], r, t_min, t_max, rec);
+            rec.primitive += o.first;
+            break;
+        case PRIMITIVE_CUSTOM:
+            is_hit = custom[o.first]->hit(r, t_min, t_max, rec);
+            rec.primitive = -1;
+            break;
+        default:
+            break;
+        }
+        if (is_hit)
+        {
+            rec.object = i;
+            rec.material = o.material;
+        }
+
+        if (object_costs)
+        {
+            ObjectCost &cost = (*object_costs)[i];
+            cost.box_tests += ray_stats.box_tests - before.box_tests;
+            cost.triangle_tests +=
+                ray_stats.triangle_tests - before.triangle_tests;
+            cost.hits += is_hit;
+        }
+        return is_hit;
+    }
+
+    // closest hit of r with every entry of one shape array, or only with
+    // the block of entries holding entry `only`
+    template <typename Shapes>
+    bool hit_shapes(const Shapes &shapes, const ray &r, const double t_min,
+                    const double t_max, HitRecord &rec,
+                    const int only = -1) const
+    {
+        if (shapes.empty())
+            return false;
+        size_t first = 0, last = shapes.size();
+        if (only >= 0)
+        {
+            first = only / SHAPE_BLOCK * SHAPE_BLOCK;
+            last = std::min(last, first + SHAPE_BLOCK);
+        }
+        ray_stats.shape_tests += last - first;
+        if (object_costs)
+            for (size_t k = first; k < last; ++k)
+                ++(*object_costs)[shapes.object[k]].shape_tests;
+
+        double t;
+        int k = shapes.hit(r, t_min, t_max, t, first, last);
+        if (k < 0)
+            return false;
+        rec.t = t;
+        rec.normal = shapes.normal(k, r.at(t));
+        rec.object = shapes.object[k];
+        rec.material = objects[rec.object].material;
+        rec.primitive = -1;
+        if (object_costs)
+            ++(*object_costs)[rec.object].hits;
+        return true;
     }
 
     bool hit(const ray &r, const double t_min, const double t_max,
@@ -46,15 +378,155 @@ struct Scene
         HitRecord temp;
         rec.t = t_max;
         bool is_hit = false;
-        for (auto &o : hittables)
+        if (accel && accel->hit(*this, r, t_min, t_max, temp))
+        {
+            rec = temp;
+            is_hit = true;
+        }
+        for (uint32_t i : looped_objects)
         {
-            if (o->hit(r, t_min, t_max, temp) && rec.t >= temp.t)
+            if (hit_object(i, r, t_min, t_max, temp) && rec.t >= temp.t)
             {
                 rec = temp;
                 is_hit = true;
             }
         }
+        // the kernels only report hits closer than rec.t
+        if (hit_shapes(single_triangles, r, t_min, rec.t, temp))
+        {
+            rec = temp;
+            is_hit = true;
+        }
+        if (hit_shapes(spheres, r, t_min, rec.t, temp))
+        {
+            rec = temp;
+            is_hit = true;
+        }
+        if (hit_shapes(planes, r, t_min, rec.t, temp))
+        {
+            rec = temp;
+            is_hit = true;
+        }
 
         return is_hit;
     }
-};
\ No newline at end of file
+
+    // whether anything lies on the shadow ray s (unit direction) closer than
+    // dist, rec receives the blocker
+    bool occluded(const ray &s, const double dist, HitRecord &rec) const
+    {
+        auto blocks = [&](const bool is_hit) {
+            return is_hit && len(s.at(rec.t) - s.origin()) < dist;
+        };
+        if (accel && blocks(accel->hit(*this, s, 0, INF, rec)))
+            return true;
+        for (uint32_t i : looped_objects)
+            if (blocks(hit_object(i, s, 0, INF, rec)))
+                return true;
+        return blocks(hit_shapes(single_triangles, s, 0, INF, rec)) ||
+               blocks(hit_shapes(spheres, s, 0, INF, rec)) ||
+               blocks(hit_shapes(planes, s, 0, INF, rec));
+    }
+
+    // closest hit of r with the primitive of an earlier hit: the triangle of
+    // a mesh, the block of shapes around a shape, a whole custom object.
+    // Returns false for records that do not belong to this scene.
+    bool hit_primitive(const int object, const int primitive, const ray &r,
+                       const double t_min, const double t_max,
+                       HitRecord &rec) const
+    {
+        if (object < 0 || size_t(object) >= objects.size())
+            return false;
+        const SceneObject &o = objects[object];
+        switch (o.type)
+        {
+        case PRIMITIVE_MESH:
+            if (primitive < 0 || size_t(primitive) >= triangles.size())
+                return false;
+            ++ray_stats.triangle_tests;
+            if (!hit_triangles(positions.data(), &triangles[primitive], 1, r,
+                               t_min, t_max, rec))
+                return false;
+            rec.primitive = primitive;
+            rec.object = object;
+            rec.material = o.material;
+            return true;
+        case PRIMITIVE_TRIANGLE:
+            return hit_shapes(single_triangles, r, t_min, t_max, rec, o.first);
+        case PRIMITIVE_SPHERE:
+            return hit_shapes(spheres, r, t_min, t_max, rec, o.first);
+        case PRIMITIVE_PLANE:
+            return hit_shapes(planes, r, t_min, t_max, rec, o.first);
+        case PRIMITIVE_CUSTOM:
+            return hit_object(object, r, t_min, t_max, rec);
+        }
+        return false;
+    }
+
+    // the material of a hit, defaults for an unknown material id
+    const Material &material_of(const HitRecord &rec) const
+    {
+        static const Material none;
+        return rec.material >= 0 ? materials[rec.material] : none;
+    }
+
+private:
+    void add_id(const std::string &id, const uint64_t hash)
+    {
+        object_ids.push_back(
+            id.empty() ? "#" + std::to_string(objects.size() - 1) : id);
+        object_hashes.push_back(hash);
+    }
+};
+
+// Mesh geometry memory, against the original layout: the scene kept the
+// double vertices of the file and every mesh a copy of all of them, plus
+// three 1-based int indices per triangle
+void print_geometry_memory(const Scene &scene, std::ostream &out)
+{
+    size_t tris = 0, meshes = 0;
+    for (const SceneObject &o : scene.objects)
+    {
+        tris += o.type == PRIMITIVE_MESH ? o.count : 0;
+        meshes += o.type == PRIMITIVE_MESH;
+    }
+    size_t before = scene.file_vertices * sizeof(point3) * (meshes + 1) +
+                    tris * 3 * sizeof(int);
+    size_t after = scene.positions.size() * sizeof(Vertex) +
+                   scene.triangles.size() * sizeof(Triangle);
+    out << "Geometry: " << tris << " mesh triangles, "
+        << scene.file_vertices << " file vertices, " << scene.mesh_vertices
+        << " used by meshes, " << scene.positions.size() << " stored ("
+        << scene.mesh_vertices - scene.positions.size() << " welded)\n"
+        << "Geometry memory: " << before << " bytes before, " << after
+        << " bytes after (" << std::fixed << std::setprecision(1)
+        << (after ? double(before) / after : 0.0) << "x smaller), scene arena "
+        << scene.arena.bytes() << " bytes\n";
+
+    if (scene.accel)
+    {
+        out << "Accelerator " << scene.accel->name() << ": "
+            << scene.accel->bytes() << " bytes\n"
+            << std::defaultfloat;
+        return;
+    }
+
+    // the same leaves under a binary hierarchy of double boxes
+    size_t leaves = 0;
+    for (const BVHNode &n : scene.bvh_nodes)
+        for (int l = 0; l < n.children; ++l)
+            leaves += n.leaf_count[l] > 0;
+    size_t binary = leaves ? (2 * leaves - 1) *
+                                 (sizeof(AxisAlignedBoundingBox) + 8)
+                           : 0;
+    size_t wide = scene.bvh_nodes.size() * sizeof(BVHNode);
+    out << "BVH" << BVH_WIDTH
+        << (scene.sbvh >= 0 ? " with spatial splits: " : ": ")
+        << scene.bvh_nodes.size() << " nodes, " << leaves << " leaves, "
+        << scene.triangles.size() << " triangle references, SAH cost "
+        << scene.bvh_sah << ", " << wide << " bytes (binary double BVH "
+        << binary << " bytes, " << (wide ? double(binary) / wide : 0.0)
+        << "x smaller)\n"
+        << std::defaultfloat;
+}
+
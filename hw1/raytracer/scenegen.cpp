@@ -0,0 +1,307 @@
+// Procedural scene generator for scalability tests. Writes scenes in the
+// XML format read by scene_from_xml_file: a floor plus `meshes` tessellated
+// spheres that together have about `triangles` triangles, lit by `lights`
+// point lights. A `mirror` fraction of the spheres use a mirror material.
+// With --analytic the spheres are written as <sphere> elements instead.
+//
+// Usage: ./scenegen [--triangles=n] [--meshes=n] [--lights=n] [--mirror=f]
+//                   [--distribution=uniform|clustered|grid] [--seed=n]
+//                   [--resolution=WxH] [--analytic] [-o out.xml]
+
+#include "vec3.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct GenOptions
+{
+    long triangles = 100000;
+    int meshes = 100;
+    int lights = 4;
+    double mirror = 0.1;
+    std::string distribution = "uniform";
+    unsigned int seed = 1;
+    int nx = 800, ny = 800;
+    bool analytic = false;
+    std::string output;
+};
+
+static bool parse_gen_options(int argc, const char *argv[], GenOptions &opt)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        try
+        {
+            if (key == "--triangles")
+                opt.triangles = std::stol(value);
+            else if (key == "--meshes")
+                opt.meshes = std::stoi(value);
+            else if (key == "--lights")
+                opt.lights = std::stoi(value);
+            else if (key == "--mirror")
+                opt.mirror = std::stod(value);
+            else if (key == "--distribution")
+                opt.distribution = value;
+            else if (key == "--seed")
+                opt.seed = std::stoul(value);
+            else if (key == "--resolution")
+            {
+                size_t x = value.find('x');
+                opt.nx = std::stoi(value.substr(0, x));
+                opt.ny = std::stoi(value.substr(x + 1));
+            }
+            else if (arg == "--analytic")
+                opt.analytic = true;
+            else if (key == "-o" && i + 1 < argc)
+                opt.output = argv[++i];
+            else
+            {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "Invalid value in option: " << arg << std::endl;
+            return false;
+        }
+    }
+    if (opt.meshes < 1 || opt.lights < 1 || opt.triangles < 1 ||
+        opt.nx < 1 || opt.ny < 1 || opt.mirror < 0 || opt.mirror > 1 ||
+        (opt.distribution != "uniform" && opt.distribution != "clustered" &&
+         opt.distribution != "grid"))
+    {
+        std::cerr << "Invalid generator parameters" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// sphere centres inside [-extent, extent]^3
+static std::vector<point3> place_meshes(const GenOptions &opt,
+                                        const double extent,
+                                        std::mt19937 &rng)
+{
+    std::uniform_real_distribution<double> uni(-extent, extent);
+    std::vector<point3> centres;
+
+    if (opt.distribution == "grid")
+    {
+        int n = std::ceil(std::cbrt(double(opt.meshes)));
+        double step = 2 * extent / n;
+        for (int k = 0; k < opt.meshes; ++k)
+            centres.push_back(point3(-extent + (k % n + 0.5) * step,
+                                     -extent + (k / n % n + 0.5) * step,
+                                     -extent + (k / (n * n) + 0.5) * step));
+    }
+    else if (opt.distribution == "clustered")
+    {
+        int n_clusters = std::max(1, opt.meshes / 20);
+        std::vector<point3> clusters;
+        for (int c = 0; c < n_clusters; ++c)
+            clusters.push_back(point3(uni(rng), uni(rng), uni(rng)) * 0.8);
+        std::normal_distribution<double> spread(0, extent * 0.1);
+        for (int k = 0; k < opt.meshes; ++k)
+        {
+            point3 p = clusters[k % n_clusters] +
+                       point3(spread(rng), spread(rng), spread(rng));
+            centres.push_back(point3(std::clamp(p.x, -extent, extent),
+                                     std::clamp(p.y, -extent, extent),
+                                     std::clamp(p.z, -extent, extent)));
+        }
+    }
+    else
+    {
+        for (int k = 0; k < opt.meshes; ++k)
+            centres.push_back(point3(uni(rng), uni(rng), uni(rng)));
+    }
+    return centres;
+}
+
+int main(int argc, const char *argv[])
+{
+    GenOptions opt;
+    if (!parse_gen_options(argc, argv, opt))
+        return -1;
+
+    std::ofstream file;
+    if (!opt.output.empty())
+    {
+        file.open(opt.output, std::ios::out);
+        if (!file.is_open())
+        {
+            std::cerr << "Error: cannot open " << opt.output << std::endl;
+            return -1;
+        }
+    }
+    std::ostream &out = opt.output.empty() ? std::cout : file;
+    std::mt19937 rng(opt.seed);
+
+    // a sphere with `slices` slices and `stacks` stacks has
+    // 2 * slices * (stacks - 1) triangles, aim for stacks = slices / 2
+    long per_mesh = std::max(4L, opt.triangles / opt.meshes);
+    int slices = std::max(3, int(std::sqrt(double(per_mesh))));
+    int stacks = std::max(2, int(per_mesh / (2 * slices) + 1));
+
+    const double extent = 10.0;
+    double radius =
+        std::max(0.05, extent / std::cbrt(double(opt.meshes)) * 0.35);
+    std::vector<point3> centres = place_meshes(opt, extent, rng);
+
+    out << "<scene>\n"
+        << "    <maxraytracedepth>6</maxraytracedepth>\n"
+        << "    <background>10 10 20</background>\n"
+        << "    <camera>\n"
+        << "        <position>0 0 " << 3 * extent << "</position>\n"
+        << "        <gaze>0 0 -1</gaze>\n"
+        << "        <up>0 1 0</up>\n"
+        << "        <nearplane>-0.5 0.5 -0.5 0.5</nearplane>\n"
+        << "        <neardistance>1</neardistance>\n"
+        << "        <imageresolution>" << opt.nx << ' ' << opt.ny
+        << "</imageresolution>\n"
+        << "    </camera>\n"
+        << "    <lights>\n"
+        << "        <ambientlight>20 20 20</ambientlight>\n";
+
+    std::uniform_real_distribution<double> unit(0, 1);
+    double intensity = 1500.0 * extent * extent / opt.lights;
+    for (int l = 0; l < opt.lights; ++l)
+    {
+        out << "        <pointlight id=\"" << l + 1 << "\">\n"
+            << "            <position>" << (2 * unit(rng) - 1) * extent << ' '
+            << extent * (1.2 + 0.5 * unit(rng)) << ' '
+            << (2 * unit(rng) - 1) * extent << "</position>\n"
+            << "            <intensity>" << intensity << ' ' << intensity
+            << ' ' << intensity << "</intensity>\n"
+            << "        </pointlight>\n";
+    }
+    out << "    </lights>\n    <materials>\n";
+
+    const int palette = 8;
+    for (int m = 0; m <= palette; ++m)
+    {
+        bool mirror = m == palette;
+        color c = mirror ? color(0.1, 0.1, 0.1)
+                         : color(0.2 + 0.8 * unit(rng), 0.2 + 0.8 * unit(rng),
+                                 0.2 + 0.8 * unit(rng));
+        out << "        <material id=\"" << (mirror ? "mirror" : "m" + std::to_string(m))
+            << "\">\n"
+            << "            <ambient>" << c * 0.1 << "</ambient>\n"
+            << "            <diffuse>" << c << "</diffuse>\n"
+            << "            <specular>0.5 0.5 0.5</specular>\n"
+            << "            <phongexponent>" << (mirror ? 50 : 10)
+            << "</phongexponent>\n"
+            << "            <mirrorreflectance>"
+            << (mirror ? "0.8 0.8 0.8" : "0 0 0") << "</mirrorreflectance>\n"
+            << "        </material>\n";
+    }
+    out << "    </materials>\n    <vertexdata>\n";
+
+    // floor first, then the sphere vertices mesh by mesh
+    double floor_y = -1.2 * extent;
+    out << -3 * extent << ' ' << floor_y << ' ' << -3 * extent << '\n'
+        << 3 * extent << ' ' << floor_y << ' ' << -3 * extent << '\n'
+        << -3 * extent << ' ' << floor_y << ' ' << 3 * extent << '\n'
+        << 3 * extent << ' ' << floor_y << ' ' << 3 * extent << '\n';
+
+    char line[128];
+    const double pi = std::acos(-1.0);
+    for (auto &c : centres)
+    {
+        if (opt.analytic)
+        {
+            snprintf(line, sizeof(line), "%.6f %.6f %.6f\n", c.x, c.y, c.z);
+            out << line;
+            continue;
+        }
+        for (int s = 0; s <= stacks; ++s)
+        {
+            double phi = pi * s / stacks;
+            // the poles are a single vertex
+            int ring = (s == 0 || s == stacks) ? 1 : slices;
+            for (int q = 0; q < ring; ++q)
+            {
+                double theta = 2 * pi * q / slices;
+                point3 p = c + radius * point3(std::sin(phi) * std::cos(theta),
+                                               std::cos(phi),
+                                               std::sin(phi) * std::sin(theta));
+                snprintf(line, sizeof(line), "%.6f %.6f %.6f\n", p.x, p.y, p.z);
+                out << line;
+            }
+        }
+    }
+    out << "    </vertexdata>\n    <objects>\n"
+        << "        <mesh id=\"floor\">\n"
+        << "            <materialid>m0</materialid>\n"
+        << "            <faces>\n3 2 1\n2 3 4\n</faces>\n"
+        << "        </mesh>\n";
+
+    long n_triangles = 2;
+    long first = 5;
+    long per_sphere = 2 + long(stacks - 1) * slices;
+    for (size_t k = 0; k < centres.size(); ++k, first += per_sphere)
+    {
+        std::string mat = unit(rng) < opt.mirror
+                              ? "mirror"
+                              : "m" + std::to_string(k % palette);
+        if (opt.analytic)
+        {
+            out << "        <sphere id=\"sphere" << k << "\">\n"
+                << "            <materialid>" << mat << "</materialid>\n"
+                << "            <center>" << 5 + k << "</center>\n"
+                << "            <radius>" << radius << "</radius>\n"
+                << "        </sphere>\n";
+            continue;
+        }
+        out << "        <mesh id=\"sphere" << k << "\">\n"
+            << "            <materialid>" << mat << "</materialid>\n"
+            << "            <faces>\n";
+
+        // ring r (1..stacks-1) starts at first + 1 + (r - 1) * slices
+        auto vid = [&](int r, int q) -> long {
+            if (r == 0)
+                return first;
+            if (r == stacks)
+                return first + per_sphere - 1;
+            return first + 1 + long(r - 1) * slices + (q % slices);
+        };
+        for (int r = 0; r < stacks; ++r)
+        {
+            for (int q = 0; q < slices; ++q)
+            {
+                long a = vid(r, q), b = vid(r, q + 1);
+                long c = vid(r + 1, q), d = vid(r + 1, q + 1);
+                if (r > 0)
+                {
+                    snprintf(line, sizeof(line), "%ld %ld %ld\n", a, b, c);
+                    out << line;
+                    ++n_triangles;
+                }
+                if (r < stacks - 1)
+                {
+                    snprintf(line, sizeof(line), "%ld %ld %ld\n", b, d, c);
+                    out << line;
+                    ++n_triangles;
+                }
+            }
+        }
+        out << "</faces>\n        </mesh>\n";
+    }
+    out << "    </objects>\n</scene>\n";
+
+    if (opt.analytic)
+        std::cerr << "Generated " << centres.size() << " spheres and a floor";
+    else
+        std::cerr << "Generated " << n_triangles << " triangles in "
+                  << centres.size() + 1 << " meshes";
+    std::cerr << " with " << opt.lights << " lights." << std::endl;
+    return out.good() ? 0 : -1;
+}
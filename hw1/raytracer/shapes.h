@@ -0,0 +1,304 @@
+#ifndef SHAPES_H
+#define SHAPES_H
+
+#include "arena.h"
+#include "axisaligbounbox.h"
+#include "helpers.h"
+#include "ray.h"
+#include "vec3.h"
+#include <cstdint>
+#include <vector>
+
+// Analytic primitives of the scene file: <sphere>, <triangle> and <plane>.
+// Every kind is stored as a structure of arrays padded to a multiple of
+// SHAPE_BLOCK entries, and its kernel tests one ray against SHAPE_BLOCK
+// entries at a time in a loop without branches that the compiler
+// vectorises (it needs -fno-math-errno -fno-trapping-math, see Makefile).
+// Padding entries can never be hit.
+
+static const int SHAPE_BLOCK = 8;
+
+// index of the smallest of the SHAPE_BLOCK distances t below best, the
+// first one on ties
+static inline int closest_in_block(const double *t, double &best)
+{
+    int k = -1;
+    for (int l = 0; l < SHAPE_BLOCK; ++l)
+    {
+        if (t[l] < best)
+        {
+            best = t[l];
+            k = l;
+        }
+    }
+    return k;
+}
+
+// Entries of one kind plus the SceneObject each of them belongs to
+struct ShapeArray
+{
+    ArenaVector<uint32_t> object;
+
+    explicit ShapeArray(std::pmr::memory_resource *mr) : object{mr} {}
+
+    size_t size() const { return object.size(); }
+    bool empty() const { return object.empty(); }
+
+protected:
+    size_t padded() const
+    {
+        return (size() + SHAPE_BLOCK - 1) / SHAPE_BLOCK * SHAPE_BLOCK;
+    }
+};
+
+struct SphereArray : ShapeArray
+{
+    ArenaVector<double> cx, cy, cz, r2;
+
+    explicit SphereArray(std::pmr::memory_resource *mr)
+        : ShapeArray{mr}, cx{mr}, cy{mr}, cz{mr}, r2{mr}
+    {
+    }
+
+    void add(const point3 &c, const double radius, const uint32_t obj)
+    {
+        cx.resize(size());
+        cy.resize(size());
+        cz.resize(size());
+        r2.resize(size());
+        cx.push_back(c.x);
+        cy.push_back(c.y);
+        cz.push_back(c.z);
+        r2.push_back(radius * radius);
+        object.push_back(obj);
+    }
+
+    // a negative squared radius makes the discriminant negative
+    void pad()
+    {
+        cx.resize(padded(), 0);
+        cy.resize(padded(), 0);
+        cz.resize(padded(), 0);
+        r2.resize(padded(), -1);
+    }
+
+    // index of the closest sphere hit in (t_min, t_max) and its t among the
+    // entries [first, last) (first a multiple of SHAPE_BLOCK), -1 when
+    // there is none. A ray starting inside a sphere hits its far side.
+    int hit(const ray &r, const double t_min, const double t_max,
+            double &t_hit, const size_t first, const size_t last) const
+    {
+        const vec3 o = r.origin(), d = r.direction();
+        const double a = dot(d, d), inv_a = 1.0 / a;
+        double best = t_max;
+        int found = -1;
+
+        for (size_t base = first; base < last; base += SHAPE_BLOCK)
+        {
+            double t[SHAPE_BLOCK];
+#pragma omp simd
+            for (int l = 0; l < SHAPE_BLOCK; ++l)
+            {
+                size_t k = base + l;
+                double x = o.x - cx[k], y = o.y - cy[k], z = o.z - cz[k];
+                double b = x * d.x + y * d.y + z * d.z;
+                double c = x * x + y * y + z * z - r2[k];
+                double disc = b * b - a * c;
+                double sq = std::sqrt(disc > 0 ? disc : 0);
+                double t0 = (-b - sq) * inv_a, t1 = (-b + sq) * inv_a;
+                double tn = t0 > t_min ? t0 : t1;
+                t[l] = (disc >= 0) & (tn > t_min) ? tn : INF;
+            }
+            int l = closest_in_block(t, best);
+            if (l >= 0)
+                found = base + l;
+        }
+        t_hit = best;
+        return found;
+    }
+
+    vec3 normal(const int k, const point3 &p) const
+    {
+        return p - point3(cx[k], cy[k], cz[k]);
+    }
+
+    AxisAlignedBoundingBox bounds(const int k) const
+    {
+        double rad = std::sqrt(r2[k]);
+        return AxisAlignedBoundingBox(
+            point3(cx[k] - rad, cy[k] - rad, cz[k] - rad),
+            point3(cx[k] + rad, cy[k] + rad, cz[k] + rad));
+    }
+};
+
+// Same test as intersect() in helpers.h, with v0 - v1 and v0 - v2 stored
+struct TriangleArray : ShapeArray
+{
+    ArenaVector<double> ax, ay, az, abx, aby, abz, acx, acy, acz;
+
+    explicit TriangleArray(std::pmr::memory_resource *mr)
+        : ShapeArray{mr}, ax{mr}, ay{mr}, az{mr}, abx{mr}, aby{mr}, abz{mr},
+          acx{mr}, acy{mr}, acz{mr}
+    {
+    }
+
+    void add(const point3 &v0, const point3 &v1, const point3 &v2,
+             const uint32_t obj)
+    {
+        vec3 ab = v0 - v1, ac = v0 - v2;
+        for (auto *v : {&ax, &ay, &az, &abx, &aby, &abz, &acx, &acy, &acz})
+            v->resize(size());
+        ax.push_back(v0.x);
+        ay.push_back(v0.y);
+        az.push_back(v0.z);
+        abx.push_back(ab.x);
+        aby.push_back(ab.y);
+        abz.push_back(ab.z);
+        acx.push_back(ac.x);
+        acy.push_back(ac.y);
+        acz.push_back(ac.z);
+        object.push_back(obj);
+    }
+
+    // degenerate padding, its determinant is 0
+    void pad()
+    {
+        for (auto *v : {&ax, &ay, &az, &abx, &aby, &abz, &acx, &acy, &acz})
+            v->resize(padded(), 0);
+    }
+
+    int hit(const ray &r, const double t_min, const double t_max,
+            double &t_hit, const size_t first, const size_t last) const
+    {
+        const vec3 o = r.origin(), d = r.direction();
+        double best = t_max;
+        int found = -1;
+
+        for (size_t base = first; base < last; base += SHAPE_BLOCK)
+        {
+            double t[SHAPE_BLOCK];
+#pragma omp simd
+            for (int l = 0; l < SHAPE_BLOCK; ++l)
+            {
+                size_t k = base + l;
+                // determinant(a_b, a_c, d) and friends, expanded
+                double m0 = acy[k] * d.z - d.y * acz[k];
+                double m1 = d.x * acz[k] - d.z * acx[k];
+                double m2 = acx[k] * d.y - acy[k] * d.x;
+                double det = abx[k] * m0 + aby[k] * m1 + abz[k] * m2;
+                double inv_det = 1.0 / det;
+
+                double aox = ax[k] - o.x, aoy = ay[k] - o.y, aoz = az[k] - o.z;
+                double beta = (aox * m0 + aoy * m1 + aoz * m2) * inv_det;
+                double gamma = (abx[k] * (aoy * d.z - d.y * aoz) +
+                                aby[k] * (d.x * aoz - d.z * aox) +
+                                abz[k] * (aox * d.y - aoy * d.x)) *
+                               inv_det;
+                double tt = (abx[k] * (acy[k] * aoz - aoy * acz[k]) +
+                             aby[k] * (aox * acz[k] - aoz * acx[k]) +
+                             abz[k] * (acx[k] * aoy - acy[k] * aox)) *
+                            inv_det;
+                bool ok = ((det <= -EPSILON) | (det >= EPSILON)) &
+                          (beta >= 0) & (gamma >= 0) & (beta + gamma <= 1) &
+                          (tt > t_min);
+                t[l] = ok ? tt : INF;
+            }
+            int l = closest_in_block(t, best);
+            if (l >= 0)
+                found = base + l;
+        }
+        t_hit = best;
+        return found;
+    }
+
+    // (v1 - v0) x (v2 - v0), like a mesh triangle
+    vec3 normal(const int k, const point3 &) const
+    {
+        return cross(-vec3(abx[k], aby[k], abz[k]),
+                     -vec3(acx[k], acy[k], acz[k]));
+    }
+
+    AxisAlignedBoundingBox bounds(const int k) const
+    {
+        point3 v0(ax[k], ay[k], az[k]);
+        AxisAlignedBoundingBox box;
+        box.expand(v0);
+        box.expand(v0 - vec3(abx[k], aby[k], abz[k]));
+        box.expand(v0 - vec3(acx[k], acy[k], acz[k]));
+        return box;
+    }
+};
+
+// Infinite planes through a point, lit on the side their normal faces
+struct PlaneArray : ShapeArray
+{
+    ArenaVector<double> px, py, pz, nx, ny, nz;
+
+    explicit PlaneArray(std::pmr::memory_resource *mr)
+        : ShapeArray{mr}, px{mr}, py{mr}, pz{mr}, nx{mr}, ny{mr}, nz{mr}
+    {
+    }
+
+    void add(const point3 &p, const vec3 &n, const uint32_t obj)
+    {
+        for (auto *v : {&px, &py, &pz, &nx, &ny, &nz})
+            v->resize(size());
+        px.push_back(p.x);
+        py.push_back(p.y);
+        pz.push_back(p.z);
+        nx.push_back(n.x);
+        ny.push_back(n.y);
+        nz.push_back(n.z);
+        object.push_back(obj);
+    }
+
+    // a zero normal is parallel to every ray
+    void pad()
+    {
+        for (auto *v : {&px, &py, &pz, &nx, &ny, &nz})
+            v->resize(padded(), 0);
+    }
+
+    int hit(const ray &r, const double t_min, const double t_max,
+            double &t_hit, const size_t first, const size_t last) const
+    {
+        const vec3 o = r.origin(), d = r.direction();
+        double best = t_max;
+        int found = -1;
+
+        for (size_t base = first; base < last; base += SHAPE_BLOCK)
+        {
+            double t[SHAPE_BLOCK];
+#pragma omp simd
+            for (int l = 0; l < SHAPE_BLOCK; ++l)
+            {
+                size_t k = base + l;
+                double denom = d.x * nx[k] + d.y * ny[k] + d.z * nz[k];
+                double num = (px[k] - o.x) * nx[k] + (py[k] - o.y) * ny[k] +
+                             (pz[k] - o.z) * nz[k];
+                double tt = num / denom;
+                bool ok = ((denom <= -EPSILON) | (denom >= EPSILON)) &
+                          (tt > t_min);
+                t[l] = ok ? tt : INF;
+            }
+            int l = closest_in_block(t, best);
+            if (l >= 0)
+                found = base + l;
+        }
+        t_hit = best;
+        return found;
+    }
+
+    vec3 normal(const int k, const point3 &) const
+    {
+        return vec3(nx[k], ny[k], nz[k]);
+    }
+
+    AxisAlignedBoundingBox bounds(const int) const
+    {
+        return AxisAlignedBoundingBox(point3(-INF, -INF, -INF),
+                                      point3(INF, INF, INF));
+    }
+};
+
+#endif // SHAPES_H
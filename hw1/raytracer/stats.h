@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Ray and intersection counters. Every thread counts into its own
+// ray_stats, parallel_for merges them into the process totals when its
+// workers finish.
+struct RayStats
+{
+    uint64_t primary{0}, shadow{0}, reflection{0};
+    uint64_t triangle_tests{0}, box_tests{0};
+    // tests against the analytic shapes of shapes.h
+    uint64_t shape_tests{0};
+    // lights skipped by the influence radius cutoff, see lights.h
+    uint64_t lights_culled{0};
+    // shadow rays that tried the cached blocker of their light, and how
+    // many of them it blocked
+    uint64_t shadow_cache_tests{0}, shadow_cache_hits{0};
+    // camera rays that tried the primitive hit by the previous pixel, and
+    // how many of them hit it
+    uint64_t primary_cache_tests{0}, primary_cache_hits{0};
+
+    uint64_t rays() const { return primary + shadow + reflection; }
+    uint64_t tests() const { return triangle_tests + box_tests + shape_tests; }
+
+    void add(const RayStats &s)
+    {
+        primary += s.primary;
+        shadow += s.shadow;
+        reflection += s.reflection;
+        triangle_tests += s.triangle_tests;
+        box_tests += s.box_tests;
+        shape_tests += s.shape_tests;
+        lights_culled += s.lights_culled;
+        shadow_cache_tests += s.shadow_cache_tests;
+        shadow_cache_hits += s.shadow_cache_hits;
+        primary_cache_tests += s.primary_cache_tests;
+        primary_cache_hits += s.primary_cache_hits;
+    }
+};
+
+static thread_local RayStats ray_stats;
+
+// Tests charged to one scene object while profiling, see Scene::hit_object
+struct ObjectCost
+{
+    uint64_t box_tests{0}, triangle_tests{0}, shape_tests{0}, hits{0};
+
+    uint64_t tests() const { return box_tests + triangle_tests + shape_tests; }
+
+    void add(const ObjectCost &c)
+    {
+        box_tests += c.box_tests;
+        triangle_tests += c.triangle_tests;
+        shape_tests += c.shape_tests;
+        hits += c.hits;
+    }
+};
+
+// per-object costs of the current thread, nullptr when not profiling
+static thread_local std::vector<ObjectCost> *object_costs = nullptr;
+
+class StatsTotal
+{
+public:
+    void merge(RayStats &local)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_total.add(local);
+        local = RayStats();
+    }
+
+    RayStats take()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        RayStats t = m_total;
+        m_total = RayStats();
+        return t;
+    }
+
+private:
+    std::mutex m_mutex;
+    RayStats m_total;
+};
+
+static StatsTotal stats_total;
+
+#endif // STATS_H
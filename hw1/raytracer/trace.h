@@ -0,0 +1,139 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Scoped timers written as a Chrome trace (chrome://tracing, Perfetto).
+// They only exist when built with -DRT_TRACE (make TRACE=1); otherwise
+// TRACE_SCOPE expands to nothing and costs nothing.
+
+#ifdef RT_TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct TraceEvent
+{
+    const char *name;
+    double ts, dur; // microseconds since start
+    int arg;        // tile index or -1
+};
+
+class Tracer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool enabled() const { return m_enabled; }
+    void enable() { m_enabled = true; }
+
+    double now() const
+    {
+        return std::chrono::duration<double, std::micro>(clock::now() -
+                                                         m_start)
+            .count();
+    }
+
+    // events of the calling thread, registered on first use
+    std::vector<TraceEvent> &events()
+    {
+        thread_local std::vector<TraceEvent> *buffer = nullptr;
+        if (!buffer)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_threads.emplace_back();
+            buffer = &m_threads.back();
+        }
+        return *buffer;
+    }
+
+    // call once all worker threads have joined
+    bool write(const std::string &path)
+    {
+        std::ofstream out{path, std::ios::out};
+        if (!out.is_open())
+            return false;
+        out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+        bool first = true;
+        int tid = 0;
+        for (auto &thread : m_threads)
+        {
+            out << (first ? "" : ",\n")
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                << "\"tid\":" << tid << ",\"args\":{\"name\":\""
+                << (tid ? "thread " + std::to_string(tid) : "main")
+                << "\"}}";
+            first = false;
+            for (auto &e : thread)
+            {
+                out << ",\n{\"name\":\"" << e.name
+                    << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                    << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur;
+                if (e.arg >= 0)
+                    out << ",\"args\":{\"tile\":" << e.arg << "}";
+                out << "}";
+            }
+            ++tid;
+        }
+        out << "\n]}\n";
+        return out.good();
+    }
+
+private:
+    Tracer() : m_start{clock::now()} { events(); }
+
+    bool m_enabled = false;
+    clock::time_point m_start;
+    std::mutex m_mutex;
+    std::deque<std::vector<TraceEvent>> m_threads;
+};
+
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *name, const int arg = -1)
+        : m_name{name}, m_arg{arg},
+          m_start{Tracer::instance().enabled() ? Tracer::instance().now() : -1}
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (m_start < 0)
+            return;
+        Tracer &tracer = Tracer::instance();
+        tracer.events().push_back(
+            {m_name, m_start, tracer.now() - m_start, m_arg});
+    }
+
+private:
+    const char *m_name;
+    int m_arg;
+    double m_start;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(...) \
+    TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#else
+
+#define TRACE_SCOPE(...) \
+    do                   \
+    {                    \
+    } while (0)
+
+#endif // RT_TRACE
+
+#endif // TRACE_H
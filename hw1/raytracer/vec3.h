@@ -65,6 +65,11 @@ inline std::ostream &operator<<(std::ostream &out, const vec3 &v)
     return out << v.x << ' ' << v.y << ' ' << v.z;
 }
 
+inline bool operator==(const vec3 &v1, const vec3 &v2)
+{
+    return v1.x == v2.x && v1.y == v2.y && v1.z == v2.z;
+}
+
 inline vec3 operator+(const vec3 &v1, const vec3 &v2)
 {
     return vec3(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
@@ -1,13 +1,20 @@
+#ifndef XML_H
+#define XML_H
+
 #include <iostream>
 #include <fstream>
 #include "pugixml/src/pugixml.hpp"
 #include <sstream>
 #include "scene.h"
 #include "mesh.h"
+#include "trace.h"
 
 using namespace pugi;
 using namespace std;
 
+// largest image resolution a scene may ask for
+static const double MAX_IMAGE_PIXELS = double(1 << 28);
+
 vector<double> tokenize(const char *str)
 {
     vector<double> tokens;
@@ -32,6 +39,19 @@ vector<int> tokenize_int(const char *str)
     return tokens;
 }
 
+// number of whitespace separated tokens, without parsing them
+size_t count_tokens(const char *str)
+{
+    size_t n = 0;
+    for (bool in_token = false; *str; ++str)
+    {
+        bool space = isspace((unsigned char)*str);
+        n += !space && !in_token;
+        in_token = !space;
+    }
+    return n;
+}
+
 vec3 v_to_v3(const vector<double> &v)
 {
     return vec3(v[0], v[1], v[2]);
@@ -41,7 +61,7 @@ vector<vec3> str_to_vv3(const char *str)
 {
     vector<double> v = tokenize(str);
     vector<vec3> vv3;
-    for (size_t i = 0; i < v.size(); i += 3)
+    for (size_t i = 0; i + 2 < v.size(); i += 3)
         vv3.push_back(point3(v[i], v[i + 1], v[i + 2]));
     return vv3;
 }
@@ -64,18 +84,47 @@ inline bool is_valid(const char_t *p, const string &id, const string &error_msg,
     return is_valid(p, id + error_msg, err);
 }
 
-bool scene_from_xml_file(Scene &scene, const char *path)
+// reads exactly n numbers from str into v, reports where otherwise
+bool read_values(const char *str, const size_t n, const string &where,
+                 vector<double> &v, bool &err)
 {
-    bool err = true;
+    v = tokenize(str);
+    if (v.size() == n && count_tokens(str) == n)
+        return true;
+    cerr << "XML error: " << where << " needs " << n
+         << (n == 1 ? " number" : " numbers") << endl;
+    err = false;
+    return false;
+}
 
-    xml_document doc;
-    doc.load_file(path, parse_trim_pcdata);
+bool read_vec3(const char *str, const string &where, vec3 &v, bool &err)
+{
+    vector<double> tok;
+    if (!read_values(str, 3, where, tok, err))
+        return false;
+    v = v_to_v3(tok);
+    return true;
+}
 
-    if (!doc.first_child())
+// a 1-based vertex id
+bool read_index(const char *str, const string &where, int &i, bool &err)
+{
+    vector<int> tok = tokenize_int(str);
+    if (tok.size() == 1 && count_tokens(str) == 1)
     {
-        cerr << "Error: Can't open input file!" << endl;
-        return false;
+        i = tok[0];
+        return true;
     }
+    cerr << "XML error: " << where << " needs one vertex id" << endl;
+    err = false;
+    return false;
+}
+
+bool scene_from_xml(Scene &scene, const xml_document &doc,
+                    const bool build = true)
+{
+    bool err = true;
+
     xml_node sc = doc.child("scene");
     xml_node camera = sc.child("camera");
     xml_node lights = sc.child("lights");
@@ -89,49 +138,74 @@ bool scene_from_xml_file(Scene &scene, const char *path)
     //     scene.max_depth = stoi(sc.child_value("maxraytracedepth"));
 
     if (is_valid(sc.child_value("background"), "-background-", err))
-        scene.background = v_to_v3(tokenize(sc.child_value("background")));
+        read_vec3(sc.child_value("background"), "background",
+                  scene.background, err);
 
     if (is_valid(camera.child_value("position"), "-camera.position-", err))
-        scene.camera.position =
-            v_to_v3(tokenize(camera.child_value("position")));
+        read_vec3(camera.child_value("position"), "camera.position",
+                  scene.camera.position, err);
 
-    if (is_valid(camera.child_value("gaze"), "-camera.gaze-", err))
-        scene.camera.w = -v_to_v3(tokenize(camera.child_value("gaze")));
+    vec3 gaze;
+    if (is_valid(camera.child_value("gaze"), "-camera.gaze-", err) &&
+        read_vec3(camera.child_value("gaze"), "camera.gaze", gaze, err))
+        scene.camera.w = -gaze;
 
-    if (is_valid(camera.child_value("position"), "-camera.position-", err))
-        scene.camera.v = v_to_v3(tokenize(camera.child_value("up")));
+    if (is_valid(camera.child_value("up"), "-camera.up-", err))
+        read_vec3(camera.child_value("up"), "camera.up", scene.camera.v, err);
 
     scene.camera.u = cross(scene.camera.v, scene.camera.w);
 
-    if (is_valid(camera.child_value("nearplane"), "-camera.nearplane-", err))
-        tok = tokenize(camera.child_value("nearplane"));
-    scene.camera.np_l = tok[0];
-    scene.camera.np_r = tok[1];
-    scene.camera.np_b = tok[2];
-    scene.camera.np_t = tok[3];
+    if (is_valid(camera.child_value("nearplane"), "-camera.nearplane-",
+                 err) &&
+        read_values(camera.child_value("nearplane"), 4, "camera.nearplane",
+                    tok, err))
+    {
+        scene.camera.np_l = tok[0];
+        scene.camera.np_r = tok[1];
+        scene.camera.np_b = tok[2];
+        scene.camera.np_t = tok[3];
+    }
 
     if (is_valid(camera.child_value("neardistance"), "-camera.neardistance-",
-                 err))
-        scene.camera.near_dist = stod(camera.child_value("neardistance"));
+                 err) &&
+        read_values(camera.child_value("neardistance"), 1,
+                    "camera.neardistance", tok, err))
+        scene.camera.near_dist = tok[0];
 
     if (is_valid(camera.child_value("imageresolution"),
-                 "camera.imageresolution-", err))
-        tok = tokenize(camera.child_value("imageresolution"));
-    scene.camera.nx = tok[0];
-    scene.camera.ny = tok[1];
+                 "camera.imageresolution-", err) &&
+        read_values(camera.child_value("imageresolution"), 2,
+                    "camera.imageresolution", tok, err))
+    {
+        if (tok[0] >= 1 && tok[1] >= 1 && tok[0] * tok[1] <= MAX_IMAGE_PIXELS)
+        {
+            scene.camera.nx = tok[0];
+            scene.camera.ny = tok[1];
+        }
+        else
+        {
+            cerr << "XML error: camera.imageresolution is out of range"
+                 << endl;
+            err = false;
+        }
+    }
 
     if (is_valid(lights.child_value("ambientlight"), "-ambientlight-", err))
-        scene.ambient = v_to_v3(tokenize(lights.child_value("ambientlight")));
+        read_vec3(lights.child_value("ambientlight"), "ambientlight",
+                  scene.ambient, err);
 
     Pointlight p;
     for (auto light : lights.children("pointlight"))
     {
         string id = light.attribute("id").value();
+        p.id = id;
         if (is_valid(light.child_value("position"), id, ".position", err))
-            p.position = v_to_v3(tokenize(light.child_value("position")));
+            read_vec3(light.child_value("position"), id + ".position",
+                      p.position, err);
 
         if (is_valid(light.child_value("intensity"), id, ".intensity", err))
-            p.intensity = v_to_v3(tokenize(light.child_value("intensity")));
+            read_vec3(light.child_value("intensity"), id + ".intensity",
+                      p.intensity, err);
 
         scene.lights.push_back(p);
     }
@@ -142,40 +216,223 @@ bool scene_from_xml_file(Scene &scene, const char *path)
         std::string id = mat.attribute("id").as_string();
         m.id = id;
         if (is_valid(mat.child_value("ambient"), id, ".ambient", err))
-            m.ambient = v_to_v3(tokenize(mat.child_value("ambient")));
+            read_vec3(mat.child_value("ambient"), id + ".ambient", m.ambient,
+                      err);
 
         if (is_valid(mat.child_value("diffuse"), id, ".diffuse", err))
-            m.diffuse = v_to_v3(tokenize(mat.child_value("diffuse")));
+            read_vec3(mat.child_value("diffuse"), id + ".diffuse", m.diffuse,
+                      err);
 
         if (is_valid(mat.child_value("specular"), id, ".specular", err))
-            m.specular = v_to_v3(tokenize(mat.child_value("specular")));
+            read_vec3(mat.child_value("specular"), id + ".specular",
+                      m.specular, err);
 
         if (is_valid(mat.child_value("mirrorreflectance"), id,
                      ".mirrorreflectance", err))
-            m.mirror_refl =
-                v_to_v3(tokenize(mat.child_value("mirrorreflectance")));
+            read_vec3(mat.child_value("mirrorreflectance"),
+                      id + ".mirrorreflectance", m.mirror_refl, err);
 
         if (is_valid(mat.child_value("phongexponent"), id, ".phongexponent",
-                     err))
-            m.phong_exp = stoi(mat.child_value("phongexponent"));
+                     err) &&
+            read_values(mat.child_value("phongexponent"), 1,
+                        id + ".phongexponent", tok, err))
+            m.phong_exp = int(tok[0]);
 
         scene.materials.push_back(m);
     }
 
+    // file vertices are only needed while loading, meshes keep float
+    // copies of the ones they use
+    vector<point3> vertices;
     if (is_valid(sc.child_value("vertexdata"), ".vertexdata", err))
-        scene.vertices = str_to_vv3(sc.child_value("vertexdata"));
+        vertices = str_to_vv3(sc.child_value("vertexdata"));
+    scene.file_vertices = vertices.size();
 
-    for (auto o : objs.children("mesh"))
+    uint64_t h = hash_bytes(vertices.data(), vertices.size() * sizeof(point3));
+    auto vertex = [&](const int f, const string &where, point3 &p) {
+        if (f < 1 || f > int(vertices.size()))
+        {
+            cerr << "XML error: " << where << " refers to a missing vertex"
+                 << endl;
+            err = false;
+            return false;
+        }
+        p = vertices[f - 1];
+        return true;
+    };
+
+    // rebases the 1-based id f to its 0-based position in the pool, adding
+    // the vertex on first use
+    VertexWelder welder(scene.positions, scene.weld);
+    const uint32_t unused = numeric_limits<uint32_t>::max();
+    vector<uint32_t> pooled(vertices.size(), unused);
+    auto mesh_vertex = [&](const int f, const string &where, uint32_t &v) {
+        point3 p;
+        if (!vertex(f, where, p))
+            return false;
+        if (pooled[f - 1] == unused)
+        {
+            pooled[f - 1] = welder.add(p);
+            ++scene.mesh_vertices;
+        }
+        v = pooled[f - 1];
+        return true;
+    };
+
+    // sizes the arena containers once instead of growing them
+    size_t n_objects = 0, n_indices = 0;
+    for (auto o : objs.children())
+    {
+        ++n_objects;
+        if (string(o.name()) == "mesh")
+            n_indices += count_tokens(o.child_value("faces"));
+    }
+    scene.objects.reserve(scene.objects.size() + n_objects);
+    scene.object_ids.reserve(scene.object_ids.size() + n_objects);
+    scene.object_hashes.reserve(scene.object_hashes.size() + n_objects);
+    scene.triangles.reserve(scene.triangles.size() + n_indices / 3);
+    scene.positions.reserve(min(vertices.size(), n_indices));
+
+    for (auto o : objs.children())
     {
+        string kind = o.name();
         string id = o.attribute("id").value();
-        if (is_valid(o.child_value("materialid"), id, ".materialid", err) &&
-            is_valid(o.child_value("faces"), id, ".faces", err))
+        const char *mat_id = o.child_value("materialid");
+        if (kind == "mesh")
+        {
+            if (!is_valid(mat_id, id, ".materialid", err) ||
+                !is_valid(o.child_value("faces"), id, ".faces", err))
+                continue;
+
+            vector<int> faces = tokenize_int(o.child_value("faces"));
+            h = hash_bytes(faces.data(), faces.size() * sizeof(int), h);
+            h = hash_string(mat_id, h);
+
+            uint64_t mesh_h = hash_string(mat_id, hash_bytes(nullptr, 0));
+            for (int f : faces)
+                if (f >= 1 && f <= int(vertices.size()))
+                    mesh_h = hash_bytes(&vertices[f - 1], sizeof(point3),
+                                        mesh_h);
+
+            vector<Triangle> tris;
+            for (size_t j = 0; j + 2 < faces.size(); j += 3)
+            {
+                Triangle tri;
+                if (mesh_vertex(faces[j], id + ".faces", tri.v0) &&
+                    mesh_vertex(faces[j + 1], id + ".faces", tri.v1) &&
+                    mesh_vertex(faces[j + 2], id + ".faces", tri.v2))
+                    tris.push_back(tri);
+            }
+            scene.add_mesh(id, mat_id, tris, mesh_h);
+            continue;
+        }
+
+        // the analytic shapes, fingerprinted by kind, material and data
+        uint64_t obj_h =
+            hash_string(mat_id, hash_string(kind, hash_bytes(nullptr, 0)));
+        if (kind == "triangle")
+        {
+            if (!is_valid(mat_id, id, ".materialid", err) ||
+                !is_valid(o.child_value("indices"), id, ".indices", err))
+                continue;
+            vector<int> idx = tokenize_int(o.child_value("indices"));
+            point3 v[3];
+            if (idx.size() != 3)
+            {
+                cerr << "XML error: " << id << ".indices needs 3 vertices"
+                     << endl;
+                err = false;
+                continue;
+            }
+            if (!vertex(idx[0], id + ".indices", v[0]) ||
+                !vertex(idx[1], id + ".indices", v[1]) ||
+                !vertex(idx[2], id + ".indices", v[2]))
+                continue;
+            obj_h = hash_bytes(v, sizeof(v), obj_h);
+            scene.add_triangle(id, mat_id, v[0], v[1], v[2], obj_h);
+        }
+        else if (kind == "sphere")
+        {
+            if (!is_valid(mat_id, id, ".materialid", err) ||
+                !is_valid(o.child_value("center"), id, ".center", err) ||
+                !is_valid(o.child_value("radius"), id, ".radius", err))
+                continue;
+            point3 c;
+            vector<double> radius_tok;
+            int center;
+            if (!read_values(o.child_value("radius"), 1, id + ".radius",
+                             radius_tok, err) ||
+                !read_index(o.child_value("center"), id + ".center", center,
+                            err) ||
+                !vertex(center, id + ".center", c))
+                continue;
+            double radius = radius_tok[0];
+            obj_h = hash_bytes(&radius, sizeof(radius),
+                               hash_bytes(&c, sizeof(c), obj_h));
+            scene.add_sphere(id, mat_id, c, radius, obj_h);
+        }
+        else if (kind == "plane")
+        {
+            if (!is_valid(mat_id, id, ".materialid", err) ||
+                !is_valid(o.child_value("point"), id, ".point", err) ||
+                !is_valid(o.child_value("normal"), id, ".normal", err))
+                continue;
+            point3 p;
+            vector<double> n;
+            int point;
+            if (!read_values(o.child_value("normal"), 3, id + ".normal", n,
+                             err) ||
+                !read_index(o.child_value("point"), id + ".point", point,
+                            err) ||
+                !vertex(point, id + ".point", p))
+                continue;
+            obj_h = hash_bytes(n.data(), 3 * sizeof(double),
+                               hash_bytes(&p, sizeof(p), obj_h));
+            scene.add_plane(id, mat_id, p, v_to_v3(n), obj_h);
+        }
+        else
         {
-            scene.hittables.push_back(
-                new Mesh(scene.vertices, tokenize_int(o.child_value("faces")),
-                         o.child_value("materialid")));
+            continue;
         }
+        h = hash_bytes(&obj_h, sizeof(obj_h), h);
     }
+    scene.geometry_hash = h;
+    if (build)
+        scene.build();
 
     return err;
-}
\ No newline at end of file
+}
+
+bool scene_from_xml_file(Scene &scene, const char *path,
+                         const bool build = true)
+{
+    TRACE_SCOPE("scene_from_xml_file");
+    xml_document doc;
+    doc.load_file(path, parse_trim_pcdata);
+
+    if (!doc.first_child())
+    {
+        cerr << "Error: Can't open input file!" << endl;
+        return false;
+    }
+    scene.source_hash = hash_file(path);
+    return scene_from_xml(scene, doc, build);
+}
+
+// same as scene_from_xml_file for a scene received in memory
+bool scene_from_xml_buffer(Scene &scene, const string &xml,
+                           const bool build = true)
+{
+    xml_document doc;
+    doc.load_buffer(xml.data(), xml.size(), parse_trim_pcdata);
+
+    if (!doc.first_child())
+    {
+        cerr << "Error: Can't parse scene buffer!" << endl;
+        return false;
+    }
+    scene.source_hash = hash_bytes(xml.data(), xml.size());
+    return scene_from_xml(scene, doc, build);
+}
+
+#endif // XML_H